@@ -0,0 +1,528 @@
+// 端到端压测工具：多线程，每个线程一个epoll驱动一组非阻塞连接，通过回环地址压服务器
+// 可以配置并发连接数、长连接比例、流水线深度和URL的权重，输出吞吐量和延迟分布
+// 编译: g++ -O2 -pthread bench/load_gen.cpp -o load_gen
+// 运行: ./load_gen [-h 地址] [-p 端口] [-c 连接数] [-t 线程数] [-d 秒数] [-k 长连接比例0~1] [-P 流水线深度] [-u URL[:权重],...]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static const int MAX_DEPTH = 64;        //流水线深度上限
+static const int MAX_URLS = 32;
+static const int HEAD_MAX = 8192;       //响应头的最大长度
+static const int READ_CHUNK = 64 * 1024;
+
+//延迟直方图，与服务器/__stats相同的对数-线性分桶：每个2的幂区间均分成16个桶，单位纳秒
+static const int SUB_BITS = 4;
+static const int SUB_BUCKETS = 1 << SUB_BITS;
+static const int MAX_EXP = 40;
+static const int HIST_BUCKETS = (MAX_EXP - SUB_BITS + 2) * SUB_BUCKETS;
+
+static int bucket_of(uint64_t v){
+    if(v < (uint64_t)SUB_BUCKETS){
+        return (int)v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    if(e > MAX_EXP){
+        return HIST_BUCKETS - 1;
+    }
+    return (e - SUB_BITS + 1) * SUB_BUCKETS + ((v >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_low(int idx){
+    if(idx < SUB_BUCKETS){
+        return idx;
+    }
+    int e = idx / SUB_BUCKETS + SUB_BITS - 1;
+    return (uint64_t)(SUB_BUCKETS + idx % SUB_BUCKETS) << (e - SUB_BITS);
+}
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//命令行参数
+struct options {
+    struct sockaddr_in addr;
+    int connections;
+    int threads;
+    int duration;
+    double keepalive;
+    int depth;
+    int url_count;
+    const char * urls[ MAX_URLS ];
+    int weights[ MAX_URLS ];
+    int total_weight;
+};
+
+static options g_opt;
+
+//一个线程的统计
+struct stats {
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t connects;
+    uint64_t errors;
+    uint64_t status[6];         //按状态码的百位数
+    uint64_t latency_sum;
+    uint64_t latency_max;
+    uint64_t hist[ HIST_BUCKETS ];
+};
+
+enum CLIENT_STATE { CLIENT_CONNECTING = 0, CLIENT_ACTIVE };
+
+//一个客户端连接
+struct client {
+    int fd;
+    CLIENT_STATE state;
+    bool keep;                  //是否长连接，短连接每个请求新建一次连接
+    char out[ MAX_DEPTH * 128 ];
+    int out_len;
+    int out_sent;
+    int pending;                //这一批还没收到的响应数
+    uint64_t batch_start;       //这一批请求开始发送的时刻
+
+    //响应的解析状态
+    char head[ HEAD_MAX ];
+    int head_len;
+    bool in_body;
+    long body_left;
+    int status;
+};
+
+//每个线程一个
+struct worker {
+    pthread_t tid;
+    int epfd;
+    int count;
+    client * clients;
+    uint32_t rand_state;
+    uint64_t deadline;
+    stats st;
+};
+
+static uint32_t next_rand(uint32_t & s){
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    return s;
+}
+
+//按权重选一个URL
+static const char * pick_url(worker * w){
+    int r = next_rand(w->rand_state) % g_opt.total_weight;
+    for(int i = 0; i < g_opt.url_count; ++i){
+        r -= g_opt.weights[i];
+        if(r < 0){
+            return g_opt.urls[i];
+        }
+    }
+    return g_opt.urls[0];
+}
+
+//生成下一批请求：长连接一批depth个请求，短连接一个带Connection: close的请求
+static void build_batch(worker * w, client * c){
+    int n = c->keep ? g_opt.depth : 1;
+    c->out_len = 0;
+    for(int i = 0; i < n; ++i){
+        c->out_len += snprintf(c->out + c->out_len, sizeof(c->out) - c->out_len,
+            "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: %s\r\n\r\n",
+            pick_url(w), c->keep ? "keep-alive" : "close");
+    }
+    c->out_sent = 0;
+    c->pending = n;
+    c->head_len = 0;
+    c->in_body = false;
+}
+
+static void close_client(worker * w, client * c){
+    if(c->fd >= 0){
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static void start_client(worker * w, client * c){
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(c->fd < 0){
+        ++w->st.errors;
+        return;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(connect(c->fd, (struct sockaddr *)&g_opt.addr, sizeof(g_opt.addr)) < 0 && errno != EINPROGRESS){
+        ++w->st.errors;
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+    ++w->st.connects;
+    c->state = CLIENT_CONNECTING;
+    build_batch(w, c);
+
+    epoll_event ev;
+    ev.data.ptr = c;
+    ev.events = EPOLLIN | EPOLLOUT;
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+//出错或者服务器关闭连接后重新连接
+static void restart_client(worker * w, client * c){
+    close_client(w, c);
+    if(now_ns() < w->deadline){
+        start_client(w, c);
+    }
+}
+
+static void set_events(worker * w, client * c, uint32_t events){
+    epoll_event ev;
+    ev.data.ptr = c;
+    ev.events = events;
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+//发送这一批请求中剩下的部分，返回false表示连接出错
+static bool flush_client(worker * w, client * c){
+    if(c->out_sent == 0){
+        c->batch_start = now_ns();
+    }
+    while(c->out_sent < c->out_len){
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EAGAIN){
+                set_events(w, c, EPOLLIN | EPOLLOUT);
+                return true;
+            }
+            return false;
+        }
+        c->out_sent += n;
+    }
+    set_events(w, c, EPOLLIN);
+    return true;
+}
+
+//一个响应收完了
+static void response_done(worker * w, client * c){
+    uint64_t latency = now_ns() - c->batch_start;
+    stats & st = w->st;
+    ++st.requests;
+    ++st.status[ (c->status / 100) % 6 ];
+    st.latency_sum += latency;
+    if(latency > st.latency_max){
+        st.latency_max = latency;
+    }
+    ++st.hist[ bucket_of(latency) ];
+
+    --c->pending;
+    c->head_len = 0;
+    c->in_body = false;
+}
+
+//解析收到的数据，返回false表示响应格式不对
+static bool consume(worker * w, client * c, const char * data, int len){
+    while(len > 0){
+        if(!c->in_body){
+            //把数据追加到响应头里，直到找到空行
+            int take = len < HEAD_MAX - 1 - c->head_len ? len : HEAD_MAX - 1 - c->head_len;
+            if(take <= 0){
+                return false;
+            }
+            int old = c->head_len;
+            memcpy(c->head + old, data, take);
+            c->head_len += take;
+            c->head[ c->head_len ] = '\0';
+
+            //从上次结束的前3个字节开始找，防止\r\n\r\n被分在两次读里
+            char * end = strstr(c->head + (old > 3 ? old - 3 : 0), "\r\n\r\n");
+            if(!end){
+                data += take;
+                len -= take;
+                continue;
+            }
+            int head_bytes = end + 4 - c->head;
+            int used = head_bytes - old;
+            data += used;
+            len -= used;
+
+            if(strncmp(c->head, "HTTP/1.", 7) != 0){
+                return false;
+            }
+            c->status = atoi(c->head + 9);
+            char * cl = strcasestr(c->head, "\r\nContent-Length:");
+            c->body_left = cl ? atol(cl + 17) : 0;
+            c->in_body = true;
+            w->st.bytes += head_bytes;
+        }
+
+        long step = len < c->body_left ? len : c->body_left;
+        c->body_left -= step;
+        data += step;
+        len -= step;
+        w->st.bytes += step;
+        if(c->body_left == 0){
+            response_done(w, c);
+            if(c->pending == 0 && len > 0){
+                //一批的响应都收完了还有数据，说明服务器多发了
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void on_readable(worker * w, client * c){
+    static __thread char buf[ READ_CHUNK ];
+    while(true){
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if(n < 0){
+            if(errno == EAGAIN){
+                return;
+            }
+            ++w->st.errors;
+            restart_client(w, c);
+            return;
+        }
+        if(n == 0){
+            //还有响应没收到就被关闭了才算错误
+            if(c->pending > 0){
+                ++w->st.errors;
+            }
+            restart_client(w, c);
+            return;
+        }
+        if(!consume(w, c, buf, n)){
+            ++w->st.errors;
+            restart_client(w, c);
+            return;
+        }
+        if(c->pending == 0){
+            if(!c->keep || now_ns() >= w->deadline){
+                restart_client(w, c);
+                return;
+            }
+            build_batch(w, c);
+            if(!flush_client(w, c)){
+                ++w->st.errors;
+                restart_client(w, c);
+            }
+            return;
+        }
+    }
+}
+
+static void on_event(worker * w, client * c, uint32_t events){
+    if(c->state == CLIENT_CONNECTING){
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err != 0 || (events & (EPOLLERR | EPOLLHUP))){
+            ++w->st.errors;
+            restart_client(w, c);
+            return;
+        }
+        c->state = CLIENT_ACTIVE;
+    }
+    if(events & EPOLLIN){
+        on_readable(w, c);
+        if(c->fd < 0 || c->state == CLIENT_CONNECTING){
+            return;
+        }
+    }
+    else if(events & (EPOLLERR | EPOLLHUP)){
+        ++w->st.errors;
+        restart_client(w, c);
+        return;
+    }
+    if((events & EPOLLOUT) && c->out_sent < c->out_len){
+        if(!flush_client(w, c)){
+            ++w->st.errors;
+            restart_client(w, c);
+        }
+    }
+}
+
+static void * run_worker(void * arg){
+    worker * w = (worker *)arg;
+    w->epfd = epoll_create1(0);
+    for(int i = 0; i < w->count; ++i){
+        client * c = &w->clients[i];
+        c->fd = -1;
+        c->keep = (next_rand(w->rand_state) % 10000) < g_opt.keepalive * 10000;
+        start_client(w, c);
+    }
+
+    epoll_event * events = new epoll_event[ w->count + 1 ];
+    while(now_ns() < w->deadline){
+        int n = epoll_wait(w->epfd, events, w->count + 1, 100);
+        for(int i = 0; i < n; ++i){
+            on_event(w, (client *)events[i].data.ptr, events[i].events);
+        }
+    }
+    for(int i = 0; i < w->count; ++i){
+        close_client(w, &w->clients[i]);
+    }
+    delete [] events;
+    close(w->epfd);
+    return w;
+}
+
+static double percentile_us(const stats & st, double q){
+    uint64_t rank = (uint64_t)(q * st.requests + 0.999999);
+    uint64_t seen = 0;
+    for(int i = 0; i < HIST_BUCKETS; ++i){
+        seen += st.hist[i];
+        if(seen >= rank && seen > 0){
+            uint64_t high = (i + 1 < HIST_BUCKETS) ? bucket_low(i + 1) - 1 : st.latency_max;
+            return (high < st.latency_max ? high : st.latency_max) / 1000.0;
+        }
+    }
+    return st.latency_max / 1000.0;
+}
+
+//解析 URL[:权重],URL[:权重],...
+static bool parse_urls(char * list){
+    g_opt.url_count = 0;
+    g_opt.total_weight = 0;
+    for(char * tok = strtok(list, ","); tok; tok = strtok(NULL, ",")){
+        if(g_opt.url_count == MAX_URLS || tok[0] != '/'){
+            return false;
+        }
+        int weight = 1;
+        char * colon = strrchr(tok, ':');
+        if(colon){
+            *colon = '\0';
+            weight = atoi(colon + 1);
+        }
+        if(weight <= 0){
+            return false;
+        }
+        g_opt.urls[ g_opt.url_count ] = tok;
+        g_opt.weights[ g_opt.url_count++ ] = weight;
+        g_opt.total_weight += weight;
+    }
+    return g_opt.url_count > 0;
+}
+
+static void usage(const char * prog){
+    printf("用法: %s [-h 地址] [-p 端口] [-c 连接数] [-t 线程数] [-d 秒数] [-k 长连接比例0~1] [-P 流水线深度] [-u URL[:权重],...]\n", prog);
+    exit(-1);
+}
+
+int main(int argc, char * argv[]){
+    const char * host = "127.0.0.1";
+    int port = 10000;
+    char defaultUrls[] = "/index.html:4,/images/1.jpg:1,/images/image1.jpg:4";
+    char * urls = defaultUrls;
+    g_opt.connections = 100;
+    g_opt.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    g_opt.duration = 5;
+    g_opt.keepalive = 1.0;
+    g_opt.depth = 1;
+
+    int opt;
+    while((opt = getopt(argc, argv, "h:p:c:t:d:k:P:u:")) != -1){
+        switch(opt){
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': g_opt.connections = atoi(optarg); break;
+            case 't': g_opt.threads = atoi(optarg); break;
+            case 'd': g_opt.duration = atoi(optarg); break;
+            case 'k': g_opt.keepalive = atof(optarg); break;
+            case 'P': g_opt.depth = atoi(optarg); break;
+            case 'u': urls = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(g_opt.connections <= 0 || g_opt.threads <= 0 || g_opt.duration <= 0
+        || g_opt.depth <= 0 || g_opt.depth > MAX_DEPTH || !parse_urls(urls)){
+        usage(argv[0]);
+    }
+    if(g_opt.threads > g_opt.connections){
+        g_opt.threads = g_opt.connections;
+    }
+
+    memset(&g_opt.addr, 0, sizeof(g_opt.addr));
+    g_opt.addr.sin_family = AF_INET;
+    g_opt.addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, host, &g_opt.addr.sin_addr) != 1){
+        usage(argv[0]);
+    }
+
+    printf("load_gen %s:%d connections=%d threads=%d duration=%ds keepalive=%.2f pipeline=%d\n",
+        host, port, g_opt.connections, g_opt.threads, g_opt.duration, g_opt.keepalive, g_opt.depth);
+
+    //连接平均分给各个线程
+    worker * workers = new worker[ g_opt.threads ];
+    uint64_t begin = now_ns();
+    for(int i = 0; i < g_opt.threads; ++i){
+        worker * w = &workers[i];
+        memset(&w->st, 0, sizeof(w->st));
+        w->count = g_opt.connections / g_opt.threads + (i < g_opt.connections % g_opt.threads ? 1 : 0);
+        w->clients = new client[ w->count ];
+        w->rand_state = 0x9e3779b9u * (i + 1);
+        w->deadline = begin + (uint64_t)g_opt.duration * 1000000000;
+        if(pthread_create(&w->tid, NULL, run_worker, w) != 0){
+            printf("创建线程失败\n");
+            exit(-1);
+        }
+    }
+
+    stats total;
+    memset(&total, 0, sizeof(total));
+    for(int i = 0; i < g_opt.threads; ++i){
+        pthread_join(workers[i].tid, NULL);
+        const stats & st = workers[i].st;
+        total.requests += st.requests;
+        total.bytes += st.bytes;
+        total.connects += st.connects;
+        total.errors += st.errors;
+        for(int k = 0; k < 6; ++k){
+            total.status[k] += st.status[k];
+        }
+        total.latency_sum += st.latency_sum;
+        if(st.latency_max > total.latency_max){
+            total.latency_max = st.latency_max;
+        }
+        for(int k = 0; k < HIST_BUCKETS; ++k){
+            total.hist[k] += st.hist[k];
+        }
+        delete [] workers[i].clients;
+    }
+    double seconds = (now_ns() - begin) / 1e9;
+    delete [] workers;
+
+    double rps = total.requests / seconds;
+    double mbps = total.bytes / seconds / (1 << 20);
+    printf("requests    %llu (%.1f req/s, %.1f MB/s)\n", (unsigned long long)total.requests, rps, mbps);
+    printf("connects    %llu\n", (unsigned long long)total.connects);
+    printf("errors      %llu\n", (unsigned long long)total.errors);
+    printf("status      2xx=%llu 3xx=%llu 4xx=%llu 5xx=%llu\n", (unsigned long long)total.status[2],
+        (unsigned long long)total.status[3], (unsigned long long)total.status[4], (unsigned long long)total.status[5]);
+    if(total.requests == 0){
+        printf("RESULT rps=0 mbps=0 p50_us=0 p99_us=0 p999_us=0 errors=%llu\n", (unsigned long long)total.errors);
+        return 1;
+    }
+    double p50 = percentile_us(total, 0.5), p90 = percentile_us(total, 0.9);
+    double p99 = percentile_us(total, 0.99), p999 = percentile_us(total, 0.999);
+    printf("latency(us) mean=%.1f p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+        total.latency_sum / 1000.0 / total.requests, p50, p90, p99, p999, total.latency_max / 1000.0);
+    //便于脚本解析的一行
+    printf("RESULT rps=%.0f mbps=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f errors=%llu\n",
+        rps, mbps, p50, p99, p999, (unsigned long long)total.errors);
+    return 0;
+}
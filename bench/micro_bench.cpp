@@ -0,0 +1,354 @@
+// 组件微基准：不经过网络，直接测请求解析、响应生成和线程池的每次操作耗时(ns/op)与内存分配次数(allocs/op)
+// 编译: g++ -O2 -pthread bench/micro_bench.cpp $(ls *.cpp | grep -v '^main.cpp') -lz -o micro_bench
+// 运行(在仓库根目录下，响应生成要用到resources里的文件): ./micro_bench [迭代次数]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <atomic>
+#include "../http_conn.h"
+#include "../thread_pool.h"
+#include "../ws_queue.h"
+#include "../prio_queue.h"
+
+extern const char* doc_root;
+
+//统计内存分配次数：替换glibc的malloc系列，operator new最终也走malloc
+extern "C" void * __libc_malloc(size_t size);
+extern "C" void * __libc_calloc(size_t n, size_t size);
+extern "C" void * __libc_realloc(void * ptr, size_t size);
+
+static std::atomic<unsigned long> g_allocs(0);
+
+extern "C" void * malloc(size_t size){
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void * calloc(size_t n, size_t size){
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+extern "C" void * realloc(void * ptr, size_t size){
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//一项测试的结果
+struct result {
+    double ns;
+    double allocs;
+};
+
+static void report(const char * name, const result & r){
+    printf("  %-36s %10.1f ns/op %8.2f allocs/op\n", name, r.ns, r.allocs);
+}
+
+//跑5轮取最快的一轮，fn每次执行ops个操作
+template<typename Fn>
+static result measure(long iters, long ops, Fn fn){
+    result best = { 1e30, 0 };
+    for(int round = 0; round < 5; ++round){
+        unsigned long allocs = g_allocs.load();
+        uint64_t begin = now_ns();
+        for(long i = 0; i < iters; ++i){
+            fn();
+        }
+        uint64_t elapsed = now_ns() - begin;
+        double ns = (double)elapsed / (iters * ops);
+        if(ns < best.ns){
+            best.ns = ns;
+            best.allocs = (double)(g_allocs.load() - allocs) / (iters * ops);
+        }
+    }
+    return best;
+}
+
+static const char * s_browser =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 192.168.226.136:10000\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "\r\n";
+
+static const char * s_curl =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:10000\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+//通过友元访问http_conn的私有函数
+struct conn_bench {
+    http_conn conn;
+
+    conn_bench(){
+        if(!conn.attach_buf()){
+            abort();
+        }
+        conn.init();
+    }
+
+    ~conn_bench(){
+        conn.unmap();
+        conn.detach_buf();
+    }
+
+    //把一段字节流放进读缓冲区，从头开始解析
+    void load(const char * data, int len){
+        conn.init();
+        memcpy(conn.m_readBuf, data, len);
+        conn.m_read_index = len;
+        conn.m_readBuf[len] = '\0';
+    }
+
+    //解析一个请求，解析结果留在连接里
+    http_conn::HTTP_CODE parse_one(){
+        return conn.process_read();
+    }
+
+    //解析读缓冲区中所有完整的请求，返回请求数
+    int parse_all(){
+        int n = 0;
+        while(parse_one() == http_conn::GET_REQUEST){
+            ++n;
+            conn.next_request();
+        }
+        return n;
+    }
+
+    //为当前解析好的请求生成响应，然后像发送完一样清空发送队列
+    bool respond(){
+        http_conn::HTTP_CODE ret = conn.do_request();
+        bool ok = conn.process_write(ret);
+        conn.unmap();
+        conn.m_seg_head = conn.m_seg_count = 0;
+        conn.m_write_idx = 0;
+        conn.bytes_to_send = 0;
+        return ok;
+    }
+
+    bool respond_error(http_conn::HTTP_CODE code){
+        bool ok = conn.process_write(code);
+        conn.m_seg_head = conn.m_seg_count = 0;
+        conn.bytes_to_send = 0;
+        return ok;
+    }
+
+    //一个线程处理一个连接时每次都要改的热字段：交接计数和待发送字节数
+    static void touch(http_conn * c){
+        c->m_busy.fetch_add(1, std::memory_order_relaxed);
+        c->bytes_to_send += 1;
+        c->m_busy.fetch_sub(1, std::memory_order_relaxed);
+    }
+};
+
+//对照组：两个连接的同样字段落在同一个缓存行里，按缓存行对齐之前，users数组中相邻对象的首尾就是这样
+struct hot_fields {
+    std::atomic<int> m_busy;
+    off_t bytes_to_send;
+};
+
+struct alignas(CACHE_LINE_SIZE) shared_line {
+    hot_fields conns[ 2 ];
+};
+
+static void touch_shared(hot_fields * c){
+    c->m_busy.fetch_add(1, std::memory_order_relaxed);
+    c->bytes_to_send += 1;
+    c->m_busy.fetch_sub(1, std::memory_order_relaxed);
+}
+
+//两个线程各自反复修改一个连接，target是两个连接的数组
+template<typename Conn>
+struct pair_arg {
+    Conn * conn;
+    long iters;
+    void (*touch)(Conn *);
+};
+
+template<typename Conn>
+static void * touch_loop(void * arg){
+    pair_arg<Conn> * a = (pair_arg<Conn> *)arg;
+    for(long i = 0; i < a->iters; ++i){
+        a->touch(a->conn);
+        //不让编译器把循环合并成一次加法
+        __asm__ __volatile__("" ::: "memory");
+    }
+    return NULL;
+}
+
+template<typename Conn>
+static result bench_pair(long iters, Conn * conns, void (*touch)(Conn *)){
+    return measure(1, iters, [&](){
+        pthread_t tids[ 2 ];
+        pair_arg<Conn> args[ 2 ];
+        for(int i = 0; i < 2; ++i){
+            args[i].conn = conns + i;
+            args[i].iters = iters;
+            args[i].touch = touch;
+            pthread_create(tids + i, NULL, touch_loop<Conn>, args + i);
+        }
+        for(int i = 0; i < 2; ++i){
+            pthread_join(tids[i], NULL);
+        }
+    });
+}
+
+static void bench_layout(long iters){
+    printf("layout (2 threads, each updating its own neighbouring connection)\n");
+    printf("  sizeof(http_conn) = %zu, alignof = %zu\n", sizeof(http_conn), alignof(http_conn));
+    http_conn * users = new http_conn[ 2 ];
+    report("users[0] / users[1]", bench_pair<http_conn>(iters * 10, users, conn_bench::touch));
+    shared_line * line = new shared_line;
+    report("same cache line (unaligned array)", bench_pair<hot_fields>(iters * 10, line->conns, touch_shared));
+    delete line;
+    delete [] users;
+}
+
+static void bench_parser(long iters){
+    printf("parser (parse_line + process_read)\n");
+    conn_bench b;
+
+    const char * names[] = { "browser request", "curl request" };
+    const char * reqs[] = { s_browser, s_curl };
+    for(int i = 0; i < 2; ++i){
+        int len = strlen(reqs[i]);
+        result r = measure(iters, 1, [&](){
+            b.load(reqs[i], len);
+            if(b.parse_all() != 1){
+                fprintf(stderr, "parse failed\n");
+                exit(1);
+            }
+        });
+        report(names[i], r);
+    }
+
+    //同一次读到的8个流水线请求，按每个请求计
+    char pipelined[ http_conn::READ_BUF_SIZE ];
+    int len = 0;
+    for(int i = 0; i < 8; ++i){
+        len += snprintf(pipelined + len, sizeof(pipelined) - len, "%s", s_curl);
+    }
+    result r = measure(iters / 8, 8, [&](){
+        b.load(pipelined, len);
+        if(b.parse_all() != 8){
+            fprintf(stderr, "pipelined parse failed\n");
+            exit(1);
+        }
+    });
+    report("8 pipelined curl requests", r);
+}
+
+static void bench_response(long iters){
+    printf("response builder (do_request + process_write)\n");
+    conn_bench b;
+    b.load(s_curl, strlen(s_curl));
+    if(b.parse_one() != http_conn::GET_REQUEST){
+        fprintf(stderr, "parse failed\n");
+        exit(1);
+    }
+
+    result r = measure(iters, 1, [&](){
+        if(!b.respond()){
+            fprintf(stderr, "respond failed\n");
+            exit(1);
+        }
+    });
+    report("200 /index.html (cache hit)", r);
+
+    //打开静态资源包之后，同一个请求只查一次完美哈希
+    if(!static_bundle::instance()->build(doc_root, 0)){
+        fprintf(stderr, "build bundle failed\n");
+        exit(1);
+    }
+    r = measure(iters, 1, [&](){
+        if(!b.respond()){
+            fprintf(stderr, "respond failed\n");
+            exit(1);
+        }
+    });
+    report("200 /index.html (bundle hit)", r);
+
+    r = measure(iters, 1, [&](){
+        b.respond_error(http_conn::NO_RESOURCE);
+    });
+    report("404 prebuilt error", r);
+}
+
+//线程池的合成任务，只做一次计数
+struct bench_task {
+    std::atomic<long> * done;
+    void process(){
+        done->fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+//优先级队列的分类：任务轮流进各条通道，计入分类和按通道出队的开销
+static int bench_classify(bench_task * task){
+    return ((uintptr_t)task / sizeof(bench_task)) % prio_queue<bench_task>::PRIO_LANES;
+}
+
+//从一个线程提交ops个任务，等全部处理完，按每个任务计；队列满时让出CPU重试
+//线程池没有可靠的退出方式（工作线程是分离的），测完不析构，让工作线程在空队列上睡眠
+template<typename Queue>
+static void bench_pool(const char * name, long ops, int threads){
+    static const int TASKS = 1024;
+    std::atomic<long> done(0);
+    bench_task * tasks = new bench_task[ TASKS ];
+    for(int i = 0; i < TASKS; ++i){
+        tasks[i].done = &done;
+    }
+    threadPool<bench_task, Queue> * pool = new threadPool<bench_task, Queue>(threads);
+
+    long full = 0;
+    result r = measure(1, ops, [&](){
+        long target = done.load() + ops;
+        for(long i = 0; i < ops; ++i){
+            while(!pool->append(&tasks[i % TASKS])){
+                ++full;
+                sched_yield();
+            }
+        }
+        while(done.load() < target){
+            sched_yield();
+        }
+    });
+    report(name, r);
+    printf("  %-36s %10.2f full/op\n", "", (double)full / (5 * ops));
+}
+
+int main(int argc, char * argv[]){
+    long iters = argc > 1 ? atol(argv[1]) : 200000;
+
+    if(!file_cache::instance()->init(doc_root, 64 << 20, true)){
+        fprintf(stderr, "初始化文件缓存失败，需要在仓库根目录下运行\n");
+        return 1;
+    }
+
+    bench_parser(iters);
+    bench_response(iters);
+    bench_layout(iters);
+
+    printf("threadPool (append -> process, 4 workers)\n");
+    bench_pool< mpmc_queue<bench_task> >("mpmc_queue", iters, 4);
+    bench_pool< locked_queue<bench_task> >("locked_queue", iters, 4);
+    bench_pool< ws_queue<bench_task> >("ws_queue", iters, 4);
+    prio_queue<bench_task>::m_classify = bench_classify;
+    bench_pool< prio_queue<bench_task> >("prio_queue", iters, 4);
+    return 0;
+}
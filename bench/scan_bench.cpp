@@ -0,0 +1,212 @@
+// 请求行和请求头扫描的微基准：对比原来逐字节+strncasecmp链的状态机与SIMD扫描+完美哈希
+// 编译: g++ -O2 bench/scan_bench.cpp http_scan.cpp -o scan_bench
+// 运行: ./scan_bench [迭代次数]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <x86intrin.h>
+#include "../http_scan.h"
+
+//浏览器发出的典型请求和curl的最简请求
+static const char * s_requests[] = {
+    "GET /images/1.jpg HTTP/1.1\r\n"
+    "Host: 192.168.226.136:10000\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Referer: http://192.168.226.136:10000/index.html\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef\r\n"
+    "\r\n",
+
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:10000\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+};
+
+//解析结果，防止编译器把解析过程优化掉
+struct parse_result {
+    const char * url;
+    const char * host;
+    long content_length;
+    bool linger;
+    int lines;
+};
+
+//原来的做法：逐字节找\r\n，strpbrk切分请求行，strncasecmp链匹配请求头
+static bool parse_legacy(char * buf, int size, parse_result & r){
+    int start = 0;
+    bool first = true;
+    for(int i = 0; i < size; ++i){
+        if(buf[i] != '\r'){
+            continue;
+        }
+        if(i + 1 >= size || buf[i + 1] != '\n'){
+            return false;
+        }
+        buf[i] = buf[i + 1] = '\0';
+        char * text = buf + start;
+        start = i + 2;
+        ++i;
+        ++r.lines;
+
+        if(first){
+            first = false;
+            char * url = strpbrk(text, " \t");
+            if(!url){
+                return false;
+            }
+            *url++ = '\0';
+            if(strcasecmp(text, "GET") != 0){
+                return false;
+            }
+            char * version = strpbrk(url, " \t");
+            if(!version){
+                return false;
+            }
+            *version++ = '\0';
+            if(strcasecmp(version, "HTTP/1.1") != 0){
+                return false;
+            }
+            r.url = url;
+        }
+        else if(text[0] == '\0'){
+            return true;
+        }
+        else if(strncasecmp(text, "Connection:", 11) == 0){
+            text += 11;
+            text += strspn(text, " \t");
+            r.linger = strcasecmp(text, "keep-alive") == 0;
+        }
+        else if(strncasecmp(text, "Content-Length:", 15) == 0){
+            text += 15;
+            text += strspn(text, " \t");
+            r.content_length = atol(text);
+        }
+        else if(strncasecmp(text, "Host:", 5) == 0){
+            text += 5;
+            text += strspn(text, " \t");
+            r.host = text;
+        }
+    }
+    return false;
+}
+
+//现在的做法：SIMD找行尾和分隔符，完美哈希识别请求头
+static bool parse_simd(char * buf, int size, parse_result & r){
+    char * p = buf;
+    char * end = buf + size;
+    bool first = true;
+    while(p < end){
+        char * eol = (char *)find_eol(p, end);
+        if(eol + 1 >= end || eol[0] != '\r' || eol[1] != '\n'){
+            return false;
+        }
+        eol[0] = eol[1] = '\0';
+        char * text = p;
+        int len = eol - p;
+        p = eol + 2;
+        ++r.lines;
+
+        if(first){
+            first = false;
+            char * url = (char *)find_space(text, eol);
+            if(url == eol || url - text != 3 || strncasecmp(text, "GET", 3) != 0){
+                return false;
+            }
+            *url++ = '\0';
+            char * version = (char *)find_space(url, eol);
+            if(version == eol){
+                return false;
+            }
+            *version++ = '\0';
+            if(eol - version != 8 || strncasecmp(version, "HTTP/1.1", 8) != 0){
+                return false;
+            }
+            r.url = url;
+            continue;
+        }
+        if(len == 0){
+            return true;
+        }
+        char * colon = (char *)memchr(text, ':', len);
+        if(!colon){
+            return false;
+        }
+        char * value = colon + 1;
+        value += strspn(value, " \t");
+        switch(header_id(text, colon - text)){
+            case HDR_CONNECTION:
+                r.linger = strcasecmp(value, "keep-alive") == 0;
+                break;
+            case HDR_CONTENT_LENGTH:
+                r.content_length = atol(value);
+                break;
+            case HDR_HOST:
+                r.host = value;
+                break;
+            default:
+                break;
+        }
+    }
+    return false;
+}
+
+typedef bool (*parse_fn)(char *, int, parse_result &);
+
+//返回每个请求平均的周期数
+static double run(parse_fn fn, const char * request, long iters){
+    int size = strlen(request);
+    char * buf = (char *)malloc(size + 1);
+    unsigned long long best = ~0ULL;
+
+    //跑5轮取最好的一轮，减少调度和频率变化的干扰
+    for(int round = 0; round < 5; ++round){
+        unsigned long long begin = __rdtsc();
+        for(long i = 0; i < iters; ++i){
+            memcpy(buf, request, size + 1);
+            parse_result r;
+            memset(&r, 0, sizeof(r));
+            if(!fn(buf, size, r) || !r.url){
+                fprintf(stderr, "parse failed\n");
+                exit(1);
+            }
+            __asm__ __volatile__("" : : "r"(r.url), "r"(r.host), "r"(r.lines) : "memory");
+        }
+        unsigned long long cycles = __rdtsc() - begin;
+        if(cycles < best){
+            best = cycles;
+        }
+    }
+    free(buf);
+    return (double)best / iters;
+}
+
+int main(int argc, char * argv[]){
+    long iters = argc > 1 ? atol(argv[1]) : 200000;
+
+    for(size_t i = 0; i < sizeof(s_requests) / sizeof(s_requests[0]); ++i){
+        const char * req = s_requests[i];
+        printf("request %zu (%zu bytes)\n", i, strlen(req));
+
+        double legacy = run(parse_legacy, req, iters);
+        printf("  %-22s %8.1f cycles/request\n", "legacy byte loop", legacy);
+
+        SCAN_IMPL impls[] = { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+        for(size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); ++k){
+            if(!scan_select(impls[k])){
+                printf("  %-22s (not supported)\n", scan_name(impls[k]));
+                continue;
+            }
+            double c = run(parse_simd, req, iters);
+            printf("  %-22s %8.1f cycles/request  (%+.1f%%)\n", scan_name(impls[k]), c, (c - legacy) * 100.0 / legacy);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,69 @@
+#!/bin/bash
+# 端到端基准场景：编译服务器和压测工具，依次跑几组固定的场景，每个场景一行结果写进结果文件
+# 给出上一次的结果文件作为基线时逐项比较，吞吐下降或p99上升超过阈值就以非0退出，可以在每次构建后跑
+# 用法: bench/scenarios.sh [基线结果文件]
+# 环境变量: PORT(默认10000) DURATION(每个场景的秒数，默认5) THRESHOLD(允许的退化百分比，默认10)
+#           SERVER_ARGS(传给服务器的参数，如"-e uring") OUT(结果目录，默认bench/results)
+set -e
+cd "$(dirname "$0")/.."
+
+PORT=${PORT:-10000}
+DURATION=${DURATION:-5}
+THRESHOLD=${THRESHOLD:-10}
+OUT=${OUT:-bench/results}
+BASELINE=$1
+
+mkdir -p "$OUT"
+g++ -O2 *.cpp -pthread -lz -o "$OUT/server"
+g++ -O2 -pthread bench/load_gen.cpp -o "$OUT/load_gen"
+
+"$OUT/server" $PORT -L "$OUT" $SERVER_ARGS > "$OUT/server.out" 2>&1 &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null' EXIT
+sleep 1
+
+# 场景名 压测参数
+SCENARIOS=(
+    "short      -c 50 -k 0"
+    "keepalive  -c 100 -k 1"
+    "pipeline   -c 50 -k 1 -P 8"
+    "mixed      -c 200 -k 0.8 -P 2 -u /index.html:8,/images/image1.jpg:4,/images/1.jpg:1,/missing.html:1"
+    "large      -c 50 -k 1 -u /images/1.jpg"
+)
+
+RESULT="$OUT/result-$(date +%Y%m%d-%H%M%S).txt"
+echo "# scenario rps p99_us errors" > "$RESULT"
+for line in "${SCENARIOS[@]}"; do
+    read -r name args <<< "$line"
+    echo "== $name: $args"
+    output=$("$OUT/load_gen" -p $PORT -d $DURATION $args)
+    echo "$output" | grep -v '^RESULT'
+    echo "$output" | awk -v name="$name" '/^RESULT/ {
+        for(i = 2; i <= NF; ++i){ split($i, kv, "="); v[kv[1]] = kv[2] }
+        print name, v["rps"], v["p99_us"], v["errors"]
+    }' >> "$RESULT"
+done
+
+echo
+echo "结果: $RESULT"
+cat "$RESULT"
+
+if [ -z "$BASELINE" ]; then
+    exit 0
+fi
+
+# 与基线逐个场景比较
+echo
+echo "与基线 $BASELINE 比较(阈值 ${THRESHOLD}%):"
+awk -v t="$THRESHOLD" '
+    /^#/ { next }
+    NR == FNR { rps[$1] = $2; p99[$1] = $3; next }
+    ($1 in rps) {
+        drps = ($2 - rps[$1]) * 100 / rps[$1]
+        dp99 = p99[$1] > 0 ? ($3 - p99[$1]) * 100 / p99[$1] : 0
+        bad = (drps < -t || dp99 > t || $4 > 0)
+        printf "%-10s rps %+6.1f%%  p99 %+6.1f%%  errors %d  %s\n", $1, drps, dp99, $4, bad ? "REGRESSION" : "ok"
+        if(bad) fail = 1
+    }
+    END { exit fail }
+' "$BASELINE" "$RESULT"
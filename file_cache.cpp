@@ -0,0 +1,615 @@
+#include "file_cache.h"
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+
+//需要关心的inotify事件：内容、属性变化，以及增删改名
+static const uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+                                 | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+//后台压缩的文件大小范围，太小的压缩了也省不了多少，太大的占内存
+static const off_t COMPRESS_MIN = 256;
+static const off_t COMPRESS_MAX = 16 << 20;
+
+//cachestat(Linux 6.5)：统计文件一个区间里有多少页在页缓存中；旧的头文件里没有，按内核的定义写在这里
+#ifndef __NR_cachestat
+#define __NR_cachestat 451
+#endif
+struct cachestat_range {
+    uint64_t off;
+    uint64_t len;
+};
+struct cachestat {
+    uint64_t nr_cache;
+    uint64_t nr_dirty;
+    uint64_t nr_writeback;
+    uint64_t nr_evicted;
+    uint64_t nr_recently_evicted;
+};
+
+static const size_t s_pageSize = sysconf(_SC_PAGESIZE);
+
+//内核不支持cachestat时不再尝试
+static bool s_cachestat = true;
+
+file_cache * file_cache::instance(){
+    static file_cache cache;
+    return &cache;
+}
+
+file_cache::file_cache() : m_bytes(0), m_budget(0), m_mapFiles(true), m_streamMin(0), m_generation(0), m_inotifyFd(-1) {}
+
+file_cache::~file_cache(){
+    //进程退出时才会析构，映射由内核回收
+}
+
+bool file_cache::init(const char * root, size_t budget, bool mapFiles, off_t streamMin){
+    m_budget = budget;
+    m_mapFiles = mapFiles;
+    m_streamMin = streamMin;
+
+    std::string dir;
+    if(!normalize(root, dir)){
+        return false;
+    }
+
+    m_inotifyFd = inotify_init1(IN_CLOEXEC);
+    if(m_inotifyFd < 0){
+        return false;
+    }
+    addWatch(dir);
+
+    if(pthread_create(&m_watchThread, NULL, watch, this) != 0){
+        close(m_inotifyFd);
+        m_inotifyFd = -1;
+        return false;
+    }
+    pthread_detach(m_watchThread);
+
+    if(pthread_create(&m_compressThread, NULL, compressWorker, this) != 0){
+        return false;
+    }
+    pthread_detach(m_compressThread);
+    return true;
+}
+
+//把路径规范化成缓存的键：合并多余的'/'，去掉"."，拒绝".."
+//同一个文件不管URL怎么写都落到同一个键上，inotify才能准确地使其失效
+bool file_cache::normalize(const char * path, std::string & key){
+    key.clear();
+    if(path[0] == '/'){
+        key += '/';
+    }
+
+    const char * p = path;
+    while(*p){
+        while(*p == '/'){
+            ++p;
+        }
+        const char * end = p;
+        while(*end && *end != '/'){
+            ++end;
+        }
+        size_t len = end - p;
+        if(len == 0 || (len == 1 && p[0] == '.')){
+            p = end;
+            continue;
+        }
+        if(len == 2 && p[0] == '.' && p[1] == '.'){
+            return false;
+        }
+        if(!key.empty() && key[key.size() - 1] != '/'){
+            key += '/';
+        }
+        key.append(p, len);
+        p = end;
+    }
+    if(key.empty()){
+        key = ".";
+    }
+    return true;
+}
+
+file_entry * file_cache::acquire(const char * path){
+    std::string key;
+    if(!normalize(path, key)){
+        errno = EACCES;
+        return NULL;
+    }
+
+    file_entry * entry;
+    std::unordered_map<std::string, file_entry *>::iterator it;
+    for(int attempt = 0; ; ++attempt){
+        m_lock.lock();
+        it = m_entries.find(key);
+        if(it != m_entries.end()){
+            //命中：移到LRU表头
+            entry = it->second;
+            ++entry->refs;
+            m_lru.splice(m_lru.begin(), m_lru, entry->lru);
+            m_lock.unlock();
+            return entry;
+        }
+        unsigned generation = m_generation;
+        m_lock.unlock();
+
+        //未命中：在锁外做stat/open/mmap，避免阻塞其他线程的命中
+        entry = load(key);
+        if(!entry){
+            return NULL;
+        }
+
+        m_lock.lock();
+        if(m_generation == generation){
+            break;
+        }
+        //加载期间有文件失效了，读到的stat和内容可能是旧的，放进表里就要一直留到文件下次变化
+        //重新加载一次；根目录下一直有文件在变(日志、上传目录)时再变也不重试了，
+        //这次加载的条目只给这个请求用，不放进表里，最后一个引用释放时销毁
+        if(attempt >= MAX_LOAD_RETRIES){
+            entry->stale = true;
+            m_lock.unlock();
+            return entry;
+        }
+        m_lock.unlock();
+        destroy(entry);
+    }
+
+    it = m_entries.find(key);
+    if(it != m_entries.end()){
+        //其他线程抢先加载了同一个文件，用已有的条目
+        file_entry * exist = it->second;
+        ++exist->refs;
+        m_lru.splice(m_lru.begin(), m_lru, exist->lru);
+        m_lock.unlock();
+        destroy(entry);
+        return exist;
+    }
+
+    m_entries[key] = entry;
+    m_lru.push_front(entry);
+    entry->lru = m_lru.begin();
+    m_bytes += entry->bytes;
+    evict();
+    bool compress = entry->compress;
+    if(compress){
+        //压缩线程持有一个引用，压缩完之前条目不会被销毁
+        ++entry->refs;
+        m_compressQueue.push_back(entry);
+    }
+    m_lock.unlock();
+    if(compress){
+        m_compressSem.post();
+    }
+    return entry;
+}
+
+void file_cache::release(file_entry * entry){
+    bool dead = false;
+
+    m_lock.lock();
+    --entry->refs;
+    if(entry->stale){
+        dead = (entry->refs == 0);
+    }
+    else if(m_bytes > m_budget){
+        evict();
+    }
+    m_lock.unlock();
+
+    if(dead){
+        destroy(entry);
+    }
+}
+
+//读取文件信息，打开文件并建立映射，只有存在、可读的普通文件才打开
+file_entry * file_cache::load(const std::string & key){
+    struct stat st;
+    if(stat(key.c_str(), &st) < 0){
+        return NULL;
+    }
+
+    char * addr = NULL;
+    int fd = -1;
+    bool stream = false;
+    if(S_ISREG(st.st_mode) && (st.st_mode & S_IROTH)){
+        fd = open(key.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0){
+            return NULL;
+        }
+        //大文件整个映射会占住大片地址空间，超过2GB时一次也发不完，改为从描述符按窗口发送；
+        //顺序读让内核加大预读
+        stream = m_streamMin > 0 && st.st_size >= m_streamMin;
+        if(stream){
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        else if(m_mapFiles && st.st_size > 0){
+            void * p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p == MAP_FAILED){
+                close(fd);
+                return NULL;
+            }
+            addr = (char *)p;
+        }
+    }
+
+    file_entry * entry = new file_entry;
+    entry->path = key;
+    entry->st = st;
+    entry->addr = addr;
+    entry->fd = fd;
+    entry->bytes = (fd >= 0 && !stream) ? st.st_size : 0;
+    entry->refs = 1;
+    entry->stale = false;
+    entry->etag_len = 0;
+    entry->validators_len = 0;
+    entry->type = content_type_of(key.c_str());
+    entry->compress = false;
+    entry->stream = stream;
+    for(int enc = 0; enc < ENC_COUNT; ++enc){
+        entry->variants[enc].store(NULL, std::memory_order_relaxed);
+    }
+    if(fd >= 0){
+        //文件变化时inotify会让条目失效，重新加载时再生成，缓存中的验证头部总是和内容一致
+        bool vary = compressible(entry->type);
+        entry->etag_len = format_etag(entry->etag, st);
+        entry->validators_len = format_validators(entry->validators, entry->etag, entry->etag_len, st.st_mtime, ENC_IDENTITY, vary);
+
+        if(vary){
+            for(int enc = ENC_GZIP; enc < ENC_COUNT; ++enc){
+                file_variant * v = loadVariant(key, st, (ENCODING)enc);
+                if(v){
+                    entry->variants[enc].store(v, std::memory_order_relaxed);
+                    entry->bytes += v->size;
+                }
+            }
+            entry->compress = !entry->variants[ENC_GZIP].load(std::memory_order_relaxed)
+                              && st.st_size >= COMPRESS_MIN && st.st_size <= COMPRESS_MAX;
+        }
+    }
+    return entry;
+}
+
+//旁边事先压缩好的文件，比原文件旧的说明没有跟着更新，不用
+file_variant * file_cache::loadVariant(const std::string & key, const struct stat & origin, ENCODING enc){
+    std::string path = key + g_encoding_suffix[enc];
+    struct stat st;
+    if(stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode) || !(st.st_mode & S_IROTH) || st.st_mtime < origin.st_mtime){
+        return NULL;
+    }
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return NULL;
+    }
+    char * addr = NULL;
+    if(m_mapFiles && st.st_size > 0 && (m_streamMin == 0 || st.st_size < m_streamMin)){
+        void * p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p == MAP_FAILED){
+            close(fd);
+            return NULL;
+        }
+        addr = (char *)p;
+    }
+
+    file_variant * v = new file_variant;
+    v->addr = addr;
+    v->fd = fd;
+    v->size = st.st_size;
+    v->etag_len = format_etag(v->etag, st);
+    v->validators_len = format_validators(v->validators, v->etag, v->etag_len, origin.st_mtime, enc, true);
+    return v;
+}
+
+bool file_cache::resident(const char * addr, size_t len){
+    uintptr_t start = (uintptr_t)addr & ~(s_pageSize - 1);
+    uintptr_t end = (uintptr_t)addr + len;
+    unsigned char vec[ 256 ];
+    while(start < end){
+        size_t chunk = end - start < sizeof(vec) * s_pageSize ? end - start : sizeof(vec) * s_pageSize;
+        if(mincore((void *)start, chunk, vec) < 0){
+            return true;
+        }
+        size_t pages = (chunk + s_pageSize - 1) / s_pageSize;
+        for(size_t i = 0; i < pages; ++i){
+            if(!(vec[i] & 1)){
+                return false;
+            }
+        }
+        start += chunk;
+    }
+    return true;
+}
+
+bool file_cache::resident(int fd, off_t offset, size_t len){
+    if(!s_cachestat || len == 0){
+        return true;
+    }
+    cachestat_range range = { (uint64_t)offset, (uint64_t)len };
+    cachestat cs;
+    if(syscall(__NR_cachestat, fd, &range, &cs, 0) < 0){
+        if(errno == ENOSYS){
+            s_cachestat = false;
+        }
+        return true;
+    }
+    uint64_t pages = (offset + len + s_pageSize - 1) / s_pageSize - offset / s_pageSize;
+    return cs.nr_cache >= pages;
+}
+
+//先让内核把整个区间的读请求一起发出去，再逐页访问，等到全部读进来
+void file_cache::prefault(const char * addr, size_t len){
+    uintptr_t start = (uintptr_t)addr & ~(s_pageSize - 1);
+    uintptr_t end = (uintptr_t)addr + len;
+    madvise((void *)start, end - start, MADV_WILLNEED);
+    volatile char sink;
+    for(const char * p = (const char *)start; p < (const char *)end; p += s_pageSize){
+        sink = *p;
+    }
+    (void)sink;
+}
+
+void file_cache::prefault(int fd, off_t offset, size_t len){
+    posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+    static thread_local char buf[ 65536 ];
+    while(len > 0){
+        ssize_t n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+        if(n <= 0){
+            return;
+        }
+        offset += n;
+        len -= n;
+    }
+}
+
+void file_cache::destroyVariant(file_variant * v){
+    if(v->fd >= 0){
+        if(v->addr){
+            munmap(v->addr, v->size);
+        }
+        close(v->fd);
+    }
+    else {
+        free(v->addr);
+    }
+    delete v;
+}
+
+file_variant * file_cache::variant(file_entry * entry, unsigned accept){
+    static const ENCODING s_preference[] = { ENC_BR, ENC_GZIP };
+    for(int i = 0; i < 2; ++i){
+        ENCODING enc = s_preference[i];
+        if(accept & (1 << enc)){
+            file_variant * v = entry->variants[enc].load(std::memory_order_acquire);
+            if(v){
+                return v;
+            }
+        }
+    }
+    return NULL;
+}
+
+void file_cache::destroy(file_entry * entry){
+    for(int enc = ENC_GZIP; enc < ENC_COUNT; ++enc){
+        file_variant * v = entry->variants[enc].load(std::memory_order_relaxed);
+        if(v){
+            destroyVariant(v);
+        }
+    }
+    if(entry->addr){
+        munmap(entry->addr, entry->st.st_size);
+    }
+    if(entry->fd >= 0){
+        close(entry->fd);
+    }
+    delete entry;
+}
+
+//把条目从表和LRU链表中摘除，调用者持有锁；返回后条目只剩已有的引用
+void file_cache::unlink(file_entry * entry){
+    m_entries.erase(entry->path);
+    m_lru.erase(entry->lru);
+    m_bytes -= entry->bytes;
+    entry->stale = true;
+}
+
+//从LRU表尾开始淘汰没有引用的条目，直到回到容量之内，调用者持有锁
+void file_cache::evict(){
+    std::list<file_entry *>::iterator it = m_lru.end();
+    while(m_bytes > m_budget && it != m_lru.begin()){
+        --it;
+        file_entry * entry = *it;
+        if(entry->refs > 0){
+            continue;
+        }
+        it = m_lru.erase(it);
+        m_entries.erase(entry->path);
+        m_bytes -= entry->bytes;
+        destroy(entry);
+    }
+}
+
+//使path以及path目录下的所有条目失效
+void file_cache::invalidate(const std::string & path){
+    std::string prefix = path + "/";
+
+    m_lock.lock();
+    ++m_generation;
+    std::unordered_map<std::string, file_entry *>::iterator it = m_entries.begin();
+    while(it != m_entries.end()){
+        file_entry * entry = it->second;
+        ++it;
+        if(entry->path == path || entry->path.compare(0, prefix.size(), prefix) == 0){
+            unlink(entry);
+            if(entry->refs == 0){
+                destroy(entry);
+            }
+        }
+    }
+    m_lock.unlock();
+}
+
+void file_cache::invalidateAll(){
+    m_lock.lock();
+    ++m_generation;
+    while(!m_lru.empty()){
+        file_entry * entry = m_lru.front();
+        unlink(entry);
+        if(entry->refs == 0){
+            destroy(entry);
+        }
+    }
+    m_lock.unlock();
+}
+
+//递归地监视dir及其所有子目录
+void file_cache::addWatch(const std::string & dir){
+    int wd = inotify_add_watch(m_inotifyFd, dir.c_str(), WATCH_MASK | IN_ONLYDIR);
+    if(wd < 0){
+        return;
+    }
+    m_watchDirs[wd] = dir;
+
+    DIR * d = opendir(dir.c_str());
+    if(!d){
+        return;
+    }
+    struct dirent * ent;
+    while((ent = readdir(d)) != NULL){
+        if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0){
+            continue;
+        }
+        std::string sub = dir + "/" + ent->d_name;
+        struct stat st;
+        if(stat(sub.c_str(), &st) == 0 && S_ISDIR(st.st_mode)){
+            addWatch(sub);
+        }
+    }
+    closedir(d);
+}
+
+void * file_cache::watch(void * arg){
+    file_cache * cache = (file_cache *) arg;
+    cache->runWatch();
+    return cache;
+}
+
+void file_cache::runWatch(){
+    char buf[ 4096 ] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while(1){
+        ssize_t len = ::read(m_inotifyFd, buf, sizeof(buf));
+        if(len <= 0){
+            if(len < 0 && errno == EINTR){
+                continue;
+            }
+            break;
+        }
+
+        for(char * p = buf; p < buf + len; ){
+            struct inotify_event * ev = (struct inotify_event *) p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if(ev->mask & IN_Q_OVERFLOW){
+                //丢了事件，不知道哪些文件变了，全部失效
+                invalidateAll();
+                continue;
+            }
+
+            std::map<int, std::string>::iterator it = m_watchDirs.find(ev->wd);
+            if(it == m_watchDirs.end()){
+                continue;
+            }
+            if(ev->mask & IN_IGNORED){
+                m_watchDirs.erase(it);
+                continue;
+            }
+
+            std::string path = it->second;
+            if(ev->len > 0){
+                path += "/";
+                path += ev->name;
+            }
+            invalidate(path);
+
+            //预压缩文件变了，原文件的条目也要重新加载
+            for(int enc = ENC_GZIP; enc < ENC_COUNT; ++enc){
+                size_t n = strlen(g_encoding_suffix[enc]);
+                if(path.size() > n && path.compare(path.size() - n, n, g_encoding_suffix[enc]) == 0){
+                    invalidate(path.substr(0, path.size() - n));
+                }
+            }
+
+            //新建或移入的子目录也要监视
+            if((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))){
+                addWatch(path);
+            }
+        }
+    }
+}
+
+void * file_cache::compressWorker(void * arg){
+    file_cache * cache = (file_cache *) arg;
+    cache->runCompress();
+    return cache;
+}
+
+void file_cache::runCompress(){
+    while(m_compressSem.wait()){
+        m_lock.lock();
+        file_entry * entry = m_compressQueue.front();
+        m_compressQueue.pop_front();
+        m_lock.unlock();
+
+        compress(entry);
+        release(entry);
+    }
+}
+
+//把文件压缩成gzip放进内存，作为条目的ENC_GZIP版本；压缩后省不到10%的不保留
+void file_cache::compress(file_entry * entry){
+    off_t size = entry->st.st_size;
+    const char * data = entry->addr;
+    char * buf = NULL;
+    if(!data){
+        //sendfile方式下没有映射，读进临时缓冲区
+        buf = (char *)malloc(size);
+        if(!buf || pread(entry->fd, buf, size, 0) != size){
+            free(buf);
+            return;
+        }
+        data = buf;
+    }
+    size_t len = 0;
+    char * out = gzip_compress(data, size, &len);
+    free(buf);
+    if(!out || len >= (size_t)size * 9 / 10){
+        free(out);
+        return;
+    }
+
+    file_variant * v = new file_variant;
+    v->addr = out;
+    v->fd = -1;
+    v->size = len;
+    v->etag_len = format_variant_etag(v->etag, entry->etag, entry->etag_len, ENC_GZIP);
+    v->validators_len = format_validators(v->validators, v->etag, v->etag_len, entry->st.st_mtime, ENC_GZIP, true);
+
+    m_lock.lock();
+    if(entry->stale){
+        m_lock.unlock();
+        destroyVariant(v);
+        return;
+    }
+    entry->variants[ENC_GZIP].store(v, std::memory_order_release);
+    entry->bytes += len;
+    m_bytes += len;
+    evict();
+    m_lock.unlock();
+}
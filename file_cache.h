@@ -0,0 +1,141 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <atomic>
+#include "locker.h"
+#include "http_response.h"
+
+//【文件缓存】进程内所有连接共享，按路径缓存stat结果和mmap映射
+//命中时不产生任何文件系统调用；条目带引用计数，超出容量时按LRU淘汰空闲条目；
+//doc_root下的文件变化通过inotify通知后台线程，使对应条目失效
+//超过流式发送门限的大文件不映射也不计入缓存容量，只保留描述符，由sendfile/splice一个窗口一个窗口地发送
+//文本类的文件还带着压缩过的版本：优先用旁边事先压缩好的.br/.gz文件，没有.gz的由后台线程压缩一次放在内存里
+
+//文件的一个压缩版本，和所属的条目一起销毁
+struct file_variant {
+    char * addr;            //压缩后的内容：旁边的预压缩文件为只读映射(不映射时为NULL)，后台压缩的为malloc的内存
+    int fd;                 //预压缩文件的描述符，后台压缩的为-1
+    off_t size;
+    char etag[ ETAG_LEN ];
+    int etag_len;
+    char validators[ VALIDATORS_LEN ];  //验证头部，带Content-Encoding和Vary
+    int validators_len;
+};
+
+//一个缓存条目，由file_cache创建和销毁，连接只通过acquire/release持有引用
+struct file_entry {
+    std::string path;       //规范化后的完整路径，作为缓存的键
+    struct stat st;         //stat结果
+    char * addr;            //文件的只读映射，目录、不可读文件、空文件、大文件以及不映射时为NULL
+    int fd;                 //打开的只读描述符，供sendfile发送，不可发送的条目为-1
+    size_t bytes;           //计入缓存容量的字节数
+    char etag[ ETAG_LEN ];  //带引号的ETag，可发送的条目才有
+    int etag_len;
+    char validators[ VALIDATORS_LEN ];  //ETag/Last-Modified/Cache-Control三行头部，加载时生成一次
+    int validators_len;
+    CONTENT_TYPE type;      //按扩展名确定的Content-Type
+    std::atomic<file_variant *> variants[ ENC_COUNT ];  //各编码的压缩版本，没有为NULL；后台压缩完成后才设置
+    bool compress;          //加入缓存后交给后台线程压缩
+    bool stream;            //大文件，按窗口流式发送，发送过的部分不留在页缓存里
+    int refs;               //引用计数，受缓存锁保护
+    bool stale;             //已失效：不在表中，最后一个引用释放时销毁
+    std::list<file_entry *>::iterator lru;  //在LRU链表中的位置
+};
+
+class file_cache {
+public:
+    static file_cache * instance();
+
+    //开始缓存root目录下的文件，budget为缓存文件总字节数的上限，并启动inotify监视线程
+    //mapFiles为false时只保留打开的描述符而不建立映射（sendfile发送时不需要映射）
+    //不小于streamMin字节的文件作为大文件流式发送，不映射；0为不区分
+    bool init(const char * root, size_t budget, bool mapFiles = true, off_t streamMin = 0);
+
+    //从accept(按位的编码集合)中选一个条目有的压缩版本，br优先；都没有返回NULL，发送原文件
+    static file_variant * variant(file_entry * entry, unsigned accept);
+
+    //获取path对应的条目并增加引用，失败返回NULL并设置errno
+    //ENOENT: 文件不存在，EACCES: 路径中含有".."，其他: 打开或映射失败
+    file_entry * acquire(const char * path);
+
+    //释放acquire得到的引用
+    void release(file_entry * entry);
+
+    //文件内容是否都在内存里，发送时不会阻塞在磁盘上：映射的内容用mincore查，描述符的区间用cachestat查
+    //查不了(不是映射、内核不支持)时当作在内存里
+    static bool resident(const char * addr, size_t len);
+    static bool resident(int fd, off_t offset, size_t len);
+
+    //把文件内容读进内存，会阻塞在磁盘上，只在I/O线程里调用
+    static void prefault(const char * addr, size_t len);
+    static void prefault(int fd, off_t offset, size_t len);
+
+private:
+    //加载期间有条目失效时最多重新加载的次数
+    static const int MAX_LOAD_RETRIES = 1;
+
+    file_cache();
+    ~file_cache();
+
+    static bool normalize(const char * path, std::string & key);
+    file_entry * load(const std::string & key);
+    file_variant * loadVariant(const std::string & key, const struct stat & origin, ENCODING enc);
+    static void destroyVariant(file_variant * variant);
+    void destroy(file_entry * entry);
+    void unlink(file_entry * entry);
+    void evict();
+    void invalidate(const std::string & path);
+    void invalidateAll();
+
+    //inotify监视线程
+    static void * watch(void * arg);
+    void runWatch();
+    void addWatch(const std::string & dir);
+
+    //后台压缩线程
+    static void * compressWorker(void * arg);
+    void runCompress();
+    void compress(file_entry * entry);
+
+private:
+    //保护下面所有成员
+    locker m_lock;
+
+    std::unordered_map<std::string, file_entry *> m_entries;
+
+    //LRU链表，表头最近使用
+    std::list<file_entry *> m_lru;
+
+    //当前缓存的文件总字节数及其上限
+    size_t m_bytes;
+    size_t m_budget;
+
+    //是否为文件建立内存映射
+    bool m_mapFiles;
+
+    //大文件的门限，0为不区分
+    off_t m_streamMin;
+
+    //失效的代数，每次有条目失效时加一；未命中时在锁外加载前后各读一次，变了说明加载的可能是旧文件
+    unsigned m_generation;
+
+    //inotify描述符、监视描述符到目录路径的映射（只由监视线程访问）
+    int m_inotifyFd;
+    std::map<int, std::string> m_watchDirs;
+    pthread_t m_watchThread;
+
+    //等待压缩的条目，各持有一个引用；受m_lock保护
+    std::list<file_entry *> m_compressQueue;
+    sem m_compressSem;
+    pthread_t m_compressThread;
+};
+
+#endif
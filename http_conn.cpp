@@ -1,74 +1,41 @@
 #include "http_conn.h"
-
-// 定义HTTP响应的一些状态信息
-const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
-const char* error_400_form  = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
-const char* error_403_form  = "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not Found";
-const char* error_404_form  = "The requested file was not found on this server.\n";
-const char* error_500_title = "Internal Error";
-const char* error_500_form  = "There was an unusual problem serving the requested file.\n";
+#include <sys/sendfile.h>
 
 // 网站的根目录
 const char* doc_root = "./resources";
 
-int http_conn::m_epollFd = -1;
-int http_conn::m_userCnt = 0;
-
-//设置文件描述符非阻塞
-int setNonBlocking(int fd){
-    int old_flag = fcntl(fd, F_GETFL);
-    int new_flag = old_flag | O_NONBLOCK;
-    fcntl(fd, F_SETFL, new_flag);
-    return old_flag;
-}
-
-//添加需要监听的文件描述符到epoll
-void addFd(int epollFd, int fd, bool one_shot) {
-    epoll_event evt;
-    evt.data.fd = fd;
-    evt.events = EPOLLIN | EPOLLRDHUP; //可优化，EPOLLRDHUP处理异常断开，底层处理不需要移交给上层
-
-    if(one_shot) {
-        evt.events |= EPOLLONESHOT;
-    }
-    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &evt);
-
-    //设置文件描述符非阻塞
-    setNonBlocking(fd);
-}
-
-//从epoll中删除监听的文件描述符
-void rmFd(int epollFd, int fd){
-    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, 0);
-    close(fd);
-}
+// 保留的URL，返回运行统计的报告而不是文件
+static const char* STATS_URL = "/__stats";
 
-//修改文件描述符，重置socket上的EPOLLONESHOT事件， 确保下次可读时，EPOLLIN事件能被触发
-//不重新修改只触发一次
-void modFd(int epollFd, int fd, int ev) {
-    epoll_event evt;
-    evt.data.fd = fd;
-    evt.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
-    epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &evt);
-}
+padded_atomic<int> http_conn::m_userCnt(0);
+http_conn::TRANSMIT_MODE http_conn::m_transmit = http_conn::TRANSMIT_WRITEV;
+bool (*http_conn::m_prefetch)( http_conn::prefetch_task* task ) = NULL;
+int http_conn::m_queue_deadline = 0;
 
 //初始化连接
-void http_conn::init(int sockFd, const sockaddr_in & addr){
+void http_conn::init(int sockFd, const sockaddr_in & addr, io_backend * loop){
     m_sockFd = sockFd;
     m_address = addr;
-
-    //端口复用
-    int reuse = 1;
-    setsockopt(m_epollFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    
-    //添加到epoll对象中
-    addFd(m_epollFd, sockFd, true);
+    m_loop = loop;
+    m_timers = loop->timers();
+    m_timer.data = this;
+    m_prefetch_task.conn = this;
+    m_busy = 0;
+    m_inflight = 0;
+    m_closing = false;
+    m_pipe[0] = m_pipe[1] = -1;
+    m_pipe_bytes = 0;
+    m_work = WORK_NORMAL;
+
+    //先重置解析状态，再交给事件循环，否则复用的fd会带着上一个连接的状态
+    init();
+
+    //开始等待请求
     ++m_userCnt;
-    
-    // init();
+    m_loop->add(this);
+
+    //连上之后必须在限定时间内发来完整的请求头
+    m_timers->add(&m_timer, HEADER_TIMEOUT, TIMER_HEADER);
 }
 
 //初始化连接
@@ -76,32 +43,118 @@ void http_conn::init(){
 
     bytes_to_send = 0;
     bytes_have_send = 0;
+    m_seg_head = 0;
+    m_seg_count = 0;
+    m_file_count = 0;
+    m_cold = false;
+    m_keep_alive = false;
+    m_resume = false;
 
-    m_checked_index = 0;
-    m_check_state = CHECK_STATE_REQUESTLINE; //初始化状态为解析请求首行
     m_start_line = 0;
+    m_request_start = 0;
+    m_checked_index = 0;
     m_read_index = 0;
+    m_write_idx = 0;
+
+    next_request();
+}
+
+//只重置单个请求的解析状态，读缓冲区里流水线上后续请求的数据保留
+void http_conn::next_request(){
+    m_check_state = CHECK_STATE_REQUESTLINE; //初始化状态为解析请求首行
     m_method = GET;
     m_url = 0;
     m_version = 0;
     m_linger = false;
-
     m_content_length = 0;
     m_host = 0;
-    m_start_line = 0;
-    m_checked_index = 0;
-    m_read_index = 0;
-    m_write_idx = 0;
+    m_if_none_match = 0;
+    m_if_modified_since = 0;
+    m_accept_encoding = 0;
+    m_range = 0;
+    m_if_range = 0;
+    m_range_count = 0;
+    m_request_start = m_start_line;
+}
+
+//已经处理完的请求占着读缓冲区的开头，把当前请求挪到开头，给后面的数据腾出空间
+//当前请求可能已经解析了一部分，指向缓冲区的指针要跟着平移
+void http_conn::compact(){
+    int shift = m_request_start;
+    if(shift == 0){
+        return;
+    }
+    memmove(m_readBuf, m_readBuf + shift, m_read_index - shift + 1);    //连同末尾的'\0'
+    m_read_index -= shift;
+    m_checked_index -= shift;
+    m_start_line -= shift;
+    m_request_start = 0;
+    if(m_url){
+        m_url -= shift;
+    }
+    if(m_version){
+        m_version -= shift;
+    }
+    if(m_host){
+        m_host -= shift;
+    }
+    if(m_if_none_match){
+        m_if_none_match -= shift;
+    }
+    if(m_if_modified_since){
+        m_if_modified_since -= shift;
+    }
+    if(m_range){
+        m_range -= shift;
+    }
+    if(m_if_range){
+        m_if_range -= shift;
+    }
+}
+
+// 从slab内存池借一份缓冲区，内容不清零，读入的数据由read()负责以'\0'结尾
+bool http_conn::attach_buf(){
+    if(m_buf){
+        return true;
+    }
+    m_buf = slab_pool<buffers>::alloc();
+    if(!m_buf){
+        return false;
+    }
+    m_readBuf = m_buf->read;
+    m_write_buf = m_buf->write;
+    m_real_file = m_buf->file;
+    return true;
+}
 
-    bzero(m_readBuf, READ_BUF_SIZE);
-    bzero(m_write_buf, READ_BUF_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
+// 连接空闲或关闭时归还缓冲区，空闲连接不占用缓冲区内存
+void http_conn::detach_buf(){
+    if(m_buf){
+        slab_pool<buffers>::free(m_buf);
+        m_buf = NULL;
+        m_readBuf = m_write_buf = m_real_file = NULL;
+    }
 }
 
 //关闭连接
 void http_conn::close_conn(){
     if(m_sockFd != -1){
-        rmFd(m_epollFd, m_sockFd);
+        m_timers->del(&m_timer);
+        m_loop->remove(this);
+    }
+}
+
+//事件后端确认连接上没有进行中的I/O之后调用
+void http_conn::release(){
+    unmap();
+    detach_buf();
+    if(m_pipe[0] != -1){
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+        m_pipe[0] = m_pipe[1] = -1;
+    }
+    if(m_sockFd != -1){
+        close(m_sockFd);
         m_sockFd = -1;
         --m_userCnt;
     }
@@ -111,14 +164,18 @@ void http_conn::close_conn(){
 //循环读取对方数据，直到无数据可读
 bool http_conn::read(){
     
-    if(m_read_index >= READ_BUF_SIZE){
+    //缓冲区在开始读一个请求时才借用，最后一个字节留给'\0'
+    if(!attach_buf() || m_read_index >= READ_BUF_SIZE - 1){
         return false;
     }
 
+    //缓冲区为空说明这是一个新请求的开始
+    bool fresh = (m_read_index == 0);
+
     //读到的字节
     int bytes_read = 0;
     while(1){
-        bytes_read = recv(m_sockFd, m_readBuf + m_read_index, READ_BUF_SIZE - m_read_index, 0);
+        bytes_read = recv(m_sockFd, m_readBuf + m_read_index, READ_BUF_SIZE - 1 - m_read_index, 0);
         if(bytes_read == -1){
             if(errno == EAGAIN || errno == EWOULDBLOCK){
                 break; //没有数据
@@ -130,8 +187,36 @@ bool http_conn::read(){
             return false;
         }
         m_read_index += bytes_read;
+        if(m_read_index >= READ_BUF_SIZE - 1){
+            break;  //缓冲区满了，先交给解析
+        }
     }
-    printf("读到了数据: %s\n", m_readBuf);
+    return read_done(fresh);
+}
+
+//后端已经把数据读到了自己的缓冲区，拷贝进读缓冲区；放不下说明请求太长
+bool http_conn::feed(const char * data, int len){
+    if(!attach_buf() || m_read_index + len > READ_BUF_SIZE - 1){
+        return false;
+    }
+    bool fresh = (m_read_index == 0);
+    memcpy(m_readBuf + m_read_index, data, len);
+    m_read_index += len;
+    return read_done(fresh);
+}
+
+bool http_conn::read_done(bool fresh){
+    m_readBuf[m_read_index] = '\0';
+    LOG_DEBUG("fd %d 读到了数据: %s", m_sockFd, m_readBuf);
+
+    //从新请求的第一个字节开始计算读请求头的期限，之后陆续到来的数据不会延长它
+    if(fresh && m_read_index > 0){
+        m_timers->add(&m_timer, HEADER_TIMEOUT, TIMER_HEADER);
+    }
+
+    //调用者接下来会把连接交给线程池，处理完之前定时器到期也不能关闭它
+    ++m_busy;
+    m_dispatch_ns = metrics_now();
     return true;
 }
 
@@ -148,32 +233,35 @@ http_conn::HTTP_CODE http_conn::process_read(){
             //获取一行数据
 
             text = get_line();
+            int len = m_checked_index - m_start_line - 2;   //行的长度，不含末尾的\r\n
 
             m_start_line = m_checked_index; //切换起始行为当前检查的行
-            printf("get 1 http line : %s \n",text);
+            LOG_DEBUG("get 1 http line : %s", text);
 
             switch(m_check_state){
                 case CHECK_STATE_REQUESTLINE:{
-                    ret = parse_request_line(text);
+                    ret = parse_request_line(text, len);
                     if(ret == BAD_REQUEST){
                         return BAD_REQUEST;
                     }
+                    break;
                 }
 
                 case CHECK_STATE_HEADER:{
-                    ret = parse_headers(text);
+                    ret = parse_headers(text, len);
                     if(ret == BAD_REQUEST){
                         return BAD_REQUEST;
                     }
                     else if(ret == GET_REQUEST){
-                        return do_request();
+                        return GET_REQUEST;
                     }
+                    break;
                 }
 
                 case CHECK_STATE_CONTENT:{
-                    ret = parse_content(text);
+                    ret = parse_content();
                     if(ret == GET_REQUEST){
-                        return do_request();
+                        return GET_REQUEST;
                     }
                     lineStatus = LINE_OPEN;
                     break;
@@ -184,53 +272,63 @@ http_conn::HTTP_CODE http_conn::process_read(){
                 }
 
             }
-        return NO_REQUEST;
     }
-
+    if(lineStatus == LINE_BAD){
+        return BAD_REQUEST;
+    }
+    return NO_REQUEST;
 }
 
 // 解析一行，判断依据\r\n
+// 用SIMD扫描一次跳过16/32个字节，直接定位到下一个'\r'或'\n'
 http_conn::LINE_STATUS http_conn::parse_line() {
-    char temp;
-
-    for ( ; m_checked_index < m_read_index; ++m_checked_index ) {
-
-        temp = m_readBuf[ m_checked_index ];
-        if ( temp == '\r' ) {
-            if ( ( m_checked_index + 1 ) == m_read_index ) {
-                return LINE_OPEN;
-            } 
-            else if ( m_readBuf[ m_checked_index + 1 ] == '\n' ) {
-                m_readBuf[ m_checked_index++ ] = '\0';
-                m_readBuf[ m_checked_index++ ] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
+    if ( m_checked_index >= m_read_index ) {
+        return LINE_OPEN;
+    }
+
+    const char* eol = find_eol( m_readBuf + m_checked_index, m_readBuf + m_read_index );
+    m_checked_index = eol - m_readBuf;
+    if ( m_checked_index >= m_read_index ) {
+        return LINE_OPEN;
+    }
+
+    if ( *eol == '\r' ) {
+        if ( ( m_checked_index + 1 ) == m_read_index ) {
+            return LINE_OPEN;
         } 
-        
-        else if( temp == '\n' )  {
-            if( ( m_checked_index > 1) && ( m_readBuf[ m_checked_index - 1 ] == '\r' ) ) {
-                m_readBuf[ m_checked_index-1 ] = '\0';
-                m_readBuf[ m_checked_index++ ] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
+        else if ( m_readBuf[ m_checked_index + 1 ] == '\n' ) {
+            m_readBuf[ m_checked_index++ ] = '\0';
+            m_readBuf[ m_checked_index++ ] = '\0';
+            return LINE_OK;
         }
+        return LINE_BAD;
+    } 
 
+    // '\n'
+    if( ( m_checked_index > 1) && ( m_readBuf[ m_checked_index - 1 ] == '\r' ) ) {
+        m_readBuf[ m_checked_index-1 ] = '\0';
+        m_readBuf[ m_checked_index++ ] = '\0';
+        return LINE_OK;
     }
-    return LINE_OPEN;
+    return LINE_BAD;
 }
 
-//解析HTTP请求行，获得请求方法、目标URL、HTTP版本
-http_conn::HTTP_CODE http_conn::parse_request_line(char * text){
+//解析HTTP请求行，获得请求方法、目标URL、HTTP版本，len为这一行的长度
+http_conn::HTTP_CODE http_conn::parse_request_line(char * text, int len){
+    char * end = text + len;
+
     //Get /index.html HTTP/1.1
-    m_url = strpbrk(text, " \t");
+    m_url = (char *)find_space(text, end);
+    if(m_url == end){
+        return BAD_REQUEST;
+    }
 
     //Get\0 /index.html HTTP/1.1
+    int methodLen = m_url - text;
     *m_url++ = '\0';
 
     char *method = text;
-    if(strcasecmp(method, "GET") == 0){
+    if(methodLen == 3 && strncasecmp(method, "GET", 3) == 0){
         m_method = GET;
     }
     else {
@@ -238,14 +336,14 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char * text){
     }
 
     // /index.html HTTP/1.1
-    m_version = strpbrk(m_url, " \t");
-    if(!m_version){
+    m_version = (char *)find_space(m_url, end);
+    if(m_version == end){
         return BAD_REQUEST;
     }
 
     // /index.html\0 HTTP/1.1
     *m_version++ = '\0';
-    if(strcasecmp(m_version, "HTTP/1.1") != 0){
+    if(end - m_version != 8 || strncasecmp(m_version, "HTTP/1.1", 8) != 0){
         return BAD_REQUEST;
     }
 
@@ -262,10 +360,11 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char * text){
     return NO_REQUEST;
 }
 
-// 解析请求头
-http_conn::HTTP_CODE http_conn::parse_headers(char * text){
+// 解析请求头，len为这一行的长度
+// 头部名字用完美哈希识别，不再逐个strncasecmp比较
+http_conn::HTTP_CODE http_conn::parse_headers(char * text, int len){
     //遇到空行，表示头部字段解析完毕
-    if( text[0] == '\0' ) {
+    if( len == 0 ) {
         // 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体，
         // 状态机转移到CHECK_STATE_CONTENT状态
         if ( m_content_length != 0 ) {
@@ -275,37 +374,76 @@ http_conn::HTTP_CODE http_conn::parse_headers(char * text){
         // 否则说明我们已经得到了一个完整的HTTP请求
         return GET_REQUEST;
     } 
-    else if ( strncasecmp( text, "Connection:", 11 ) == 0 ) {
-        // 处理Connection 头部字段  Connection: keep-alive
-        text += 11;
-        text += strspn( text, " \t" );
-        if ( strcasecmp( text, "keep-alive" ) == 0 ) {
-            m_linger = true;
+
+    char * colon = (char *)memchr( text, ':', len );
+    if ( !colon ) {
+        return BAD_REQUEST;
+    }
+    char * value = colon + 1;
+    value += strspn( value, " \t" );
+
+    switch ( header_id( text, colon - text ) ) {
+        case HDR_CONNECTION:
+            // 处理Connection 头部字段  Connection: keep-alive
+            if ( strcasecmp( value, "keep-alive" ) == 0 ) {
+                m_linger = true;
+            }
+            break;
+        case HDR_CONTENT_LENGTH: {
+            // 处理Content-Length头部字段：只接受十进制数字，消息体要整个放进读缓冲，超过READ_BUF_SIZE的直接拒绝
+            // 负数、溢出的值会把解析位置移到缓冲区外面
+            if ( *value < '0' || *value > '9' ) {
+                return BAD_REQUEST;
+            }
+            size_t length = 0;
+            for ( ; *value >= '0' && *value <= '9'; ++value ) {
+                length = length * 10 + ( *value - '0' );
+                if ( length > ( size_t )READ_BUF_SIZE ) {
+                    return BAD_REQUEST;
+                }
+            }
+            if ( value[ strspn( value, " \t" ) ] != '\0' ) {
+                return BAD_REQUEST;
+            }
+            m_content_length = length;
+            break;
         }
-    } 
-    else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 ) {
-        // 处理Content-Length头部字段
-        text += 15;
-        text += strspn( text, " \t" );
-        m_content_length = atol(text);
-    } 
-    else if ( strncasecmp( text, "Host:", 5 ) == 0 ) {
-        // 处理Host头部字段
-        text += 5;
-        text += strspn( text, " \t" );
-        m_host = text;
-    } 
-    else {
-        printf( "oop! unknow header %s\n", text );
+        case HDR_HOST:
+            // 处理Host头部字段
+            m_host = value;
+            break;
+        case HDR_IF_NONE_MATCH:
+            m_if_none_match = value;
+            break;
+        case HDR_IF_MODIFIED_SINCE:
+            m_if_modified_since = value;
+            break;
+        case HDR_ACCEPT_ENCODING:
+            m_accept_encoding = accept_encoding( value );
+            break;
+        case HDR_RANGE:
+            m_range = value;
+            break;
+        case HDR_IF_RANGE:
+            m_if_range = value;
+            break;
+        case HDR_UNKNOWN:
+            LOG_DEBUG( "oop! unknow header %s", text );
+            break;
+        default:
+            // 认识但不需要处理的头部
+            break;
     }
     return NO_REQUEST;
 }
 
 // 没有真正解析HTTP请求的消息体，只是判断它是否被完整的读入了
-http_conn::HTTP_CODE http_conn::parse_content( char* text ) {
-    if ( m_read_index >= ( m_content_length + m_checked_index ) )
+// 消息体后面可能紧跟着流水线上的下一个请求，不能在末尾写'\0'，只把它跳过
+http_conn::HTTP_CODE http_conn::parse_content() {
+    if ( ( size_t )m_read_index >= ( size_t )m_content_length + ( size_t )m_checked_index )
     {
-        text[ m_content_length ] = '\0';
+        m_checked_index += m_content_length;
+        m_start_line = m_checked_index;
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -313,62 +451,163 @@ http_conn::HTTP_CODE http_conn::parse_content( char* text ) {
 
 http_conn::HTTP_CODE http_conn::do_request()
 {
+    if ( strcmp( m_url, STATS_URL ) == 0 ) {
+        return STATS_REQUEST;
+    }
+
+    // 打开了静态资源包时先查包，命中就不用拼路径、查文件缓存；不在包里的再按文件处理
+    m_entry = static_bundle::instance()->find( m_url, strlen( m_url ) );
+    if ( m_entry ) {
+        if ( m_accept_encoding ) {
+            const bundle_entry* variant = static_bundle::instance()->variant( m_entry, m_accept_encoding );
+            if ( variant ) {
+                m_entry = variant;
+            }
+        }
+        const char* etag = static_bundle::instance()->base() + m_entry->etag;
+        if ( not_modified( etag, m_entry->etag_len, m_entry->mtime ) ) {
+            return NOT_MODIFIED;
+        }
+        m_range_count = select_ranges( m_entry->body_len, etag, m_entry->etag_len, m_entry->mtime );
+        if ( m_range_count < 0 ) {
+            return RANGE_NOT_SATISFIABLE;
+        }
+        return BUNDLE_REQUEST;
+    }
+
     // "/home/nowcoder/webserver/resources"
     strcpy( m_real_file, doc_root );
     int len = strlen( doc_root );
     strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    // 获取m_real_file文件的相关的状态信息，-1失败，0成功
-    if ( stat( m_real_file, &m_file_stat ) < 0 ) {
-        return NO_RESOURCE;
+    m_real_file[ FILENAME_LEN - 1 ] = '\0';
+
+    // 从文件缓存中取得文件状态和内存映射，命中时不需要stat/open/mmap
+    m_file = file_cache::instance()->acquire( m_real_file );
+    if ( !m_file ) {
+        m_work = WORK_SLOW;
+        if ( errno == ENOENT || errno == ENOTDIR ) {
+            return NO_RESOURCE;
+        }
+        if ( errno == EACCES ) {
+            return FORBIDDEN_REQUEST;
+        }
+        return INTERNAL_ERROR;
     }
+    const struct stat& st = m_file->st;
+    m_work = st.st_size <= SMALL_WORK ? WORK_FAST : WORK_NORMAL;
 
     // 判断访问权限
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) ) {
+    if ( ! ( st.st_mode & S_IROTH ) ) {
+        file_cache::instance()->release( m_file );
+        m_file = 0;
         return FORBIDDEN_REQUEST;
     }
 
     // 判断是否是目录
-    if ( S_ISDIR( m_file_stat.st_mode ) ) {
+    if ( S_ISDIR( st.st_mode ) ) {
+        file_cache::instance()->release( m_file );
+        m_file = 0;
         return BAD_REQUEST;
     }
 
-    // 以只读方式打开文件
-    int fd = open( m_real_file, O_RDONLY );
-    // 创建内存映射
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
+    // 客户端接受压缩时选一个已有的压缩版本，条件请求比较的是选中版本的ETag
+    m_variant = m_accept_encoding ? file_cache::variant( m_file, m_accept_encoding ) : NULL;
+    const char* etag = m_variant ? m_variant->etag : m_file->etag;
+    int etag_len = m_variant ? m_variant->etag_len : m_file->etag_len;
+
+    // 浏览器缓存的还是最新的，只回验证头部，用不到文件内容
+    if ( not_modified( etag, etag_len, st.st_mtime ) ) {
+        return NOT_MODIFIED;
+    }
+
+    // 区间对选中的版本(可能是压缩版本)而言
+    m_range_count = select_ranges( m_variant ? m_variant->size : st.st_size, etag, etag_len, st.st_mtime );
+    if ( m_range_count < 0 ) {
+        return RANGE_NOT_SATISFIABLE;
+    }
+
+    m_file_address = m_file->addr;
     return FILE_REQUEST;
 }
 
-// 对内存映射区执行munmap操作
+// If-Range和当前版本不一致时忽略Range，发送整个文件
+int http_conn::select_ranges( off_t size, const char* etag, int etag_len, time_t mtime ) {
+    if ( !m_range ) {
+        return 0;
+    }
+    if ( m_if_range && !if_range_match( m_if_range, etag, etag_len, mtime ) ) {
+        return 0;
+    }
+    return parse_range( m_range, size, m_buf->ranges );
+}
+
+// 有If-None-Match时只看它，If-Modified-Since被忽略
+bool http_conn::not_modified( const char* etag, int etag_len, time_t mtime ) {
+    if ( m_if_none_match ) {
+        return etag_match( m_if_none_match, etag, etag_len );
+    }
+    if ( m_if_modified_since ) {
+        return not_modified_since( m_if_modified_since, mtime );
+    }
+    return false;
+}
+
+// 释放对文件缓存条目的引用，映射由缓存统一管理
+// 包括正在处理的请求取得的条目和这一批已经生成响应的条目
 void http_conn::unmap() {
-    if( m_file_address )
+    if( m_file )
     {
-        munmap( m_file_address, m_file_stat.st_size );
+        file_cache::instance()->release( m_file );
+        m_file = 0;
         m_file_address = 0;
     }
+    for( int i = 0; i < m_file_count; ++i ) {
+        file_cache::instance()->release( m_buf->files[ i ] );
+    }
+    m_file_count = 0;
+    free( m_stats );
+    m_stats = NULL;
 }
 
-// 写HTTP响应
+// 写HTTP响应，一次把这一批流水线请求的响应全部发出去
 bool http_conn::write()
 {
-    int temp = 0;
+    ssize_t temp = 0;
     
-    if ( bytes_to_send == 0 ) {
-        // 将要发送的字节为0，这一次响应结束。
-        modFd( m_epollFd, m_sockFd, EPOLLIN ); 
-        init();
-        return true;
-    }
-
-    while(1) {
-        // 分散写
-        temp = writev(m_sockFd, m_iv, m_iv_count);
+    bool progress = false;
+    off_t quantum = 0;
+
+    while ( bytes_to_send > 0 ) {
+        // 一次最多发一个窗口，大文件不会一直占着事件循环，socket还可写时EPOLLOUT马上会再来
+        if ( quantum >= SEND_WINDOW ) {
+            m_timers->add( &m_timer, WRITE_TIMEOUT, TIMER_WRITE );
+            m_loop->rearm( this, EPOLLOUT );
+            return true;
+        }
+        // 大文件接下来的窗口不在页缓存里，交给I/O线程读进来，读完由它重新注册EPOLLOUT
+        if ( cold_window() ) {
+            ++m_busy;
+            if ( m_prefetch( &m_prefetch_task ) ) {
+                metrics_add( CNT_PREFETCHES );
+                m_timers->add( &m_timer, WRITE_TIMEOUT, TIMER_WRITE );
+                return true;
+            }
+            --m_busy;
+            // I/O线程池满了，直接发
+            segment& seg = m_buf->segs[ m_seg_head ];
+            seg.warm = seg.offset + ( seg.len < ( size_t )SEND_WINDOW ? seg.len : SEND_WINDOW );
+        }
+        temp = transmit();
         if ( temp <= -1 ) {
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
             if( errno == EAGAIN ) {
-                modFd( m_epollFd, m_sockFd, EPOLLOUT );
+                metrics_add( CNT_SEND_EAGAIN );
+                // 对方迟迟不收数据时关闭连接，每次有进展都重新计时
+                if ( progress || m_timer.type != TIMER_WRITE || !m_timer.pending() ) {
+                    m_timers->add( &m_timer, WRITE_TIMEOUT, TIMER_WRITE );
+                }
+                m_loop->rearm( this, EPOLLOUT );
                 return true;
             }
             unmap();
@@ -377,159 +616,550 @@ bool http_conn::write()
 
         bytes_have_send += temp;
         bytes_to_send -= temp;
+        quantum += temp;
+        progress = true;
+        advance( temp );
+    }
 
-        if (bytes_have_send >= m_iv[0].iov_len)
-        {
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
-        }
-        else
-        {
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - temp;
-        }
+    return write_done();
+}
 
-        if (bytes_to_send <= 0)
-        {
-            // 没有数据要发送了
-            unmap();
-            modFd(m_epollFd, m_sockFd, EPOLLIN);
+// 没有数据要发送了
+bool http_conn::write_done()
+{
+    metrics_record( STAGE_SEND, metrics_now() - m_send_ns );
+    unmap();
+    m_seg_head = m_seg_count = 0;
+    m_write_idx = 0;
+    bytes_have_send = 0;
+    m_cold = false;
 
-            if (m_linger)
-            {
-                init();
-                return true;
-            }
-            else
-            {
-                return false;
-            }
-        }
+    if ( !m_keep_alive ) {
+        return false;
+    }
 
+    if ( m_read_index > 0 ) {
+        // 读缓冲区里还有流水线上的请求(或者下一个请求的开头)，新数据不一定还会到来，
+        // 不能等EPOLLIN，由事件循环直接交给线程池
+        m_timers->add( &m_timer, HEADER_TIMEOUT, TIMER_HEADER );
+        m_resume = true;
+        ++m_busy;
+        m_dispatch_ns = metrics_now();
+        return true;
     }
 
-    
+    m_loop->rearm( this, EPOLLIN );
+    init();
+    // 长连接等待下一个请求期间不占用缓冲区，空闲太久就关闭
+    detach_buf();
+    m_timers->add( &m_timer, IDLE_TIMEOUT, TIMER_IDLE );
+    return true;
 }
 
-// 往写缓冲中写入待发送的数据
-bool http_conn::add_response( const char* format, ... ) {
-    if( m_write_idx >= WRITE_BUF_SIZE ) {
+// 发送一次数据，返回发送的字节数，失败返回-1并设置errno
+ssize_t http_conn::transmit() {
+    segment* segs = m_buf->segs;
+    if ( !segs[ m_seg_head ].base ) {
+        // 文件内容直接从页缓存发送到socket，不经过用户态，sendfile自己推进offset
+        segment& seg = segs[ m_seg_head ];
+        // 只发送确认在页缓存里的部分，sendfile不会在事件循环里等磁盘
+        size_t count = seg.len < ( size_t )( seg.warm - seg.offset ) ? seg.len : seg.warm - seg.offset;
+        return sendfile( m_sockFd, seg.fd, &seg.offset, count );
+    }
+
+    // 连续的内存段合成一次分散写，后面还有文件段时带上MSG_MORE，让内核把它们合并成满的报文段
+    struct iovec iv[ MAX_SEGMENTS ];
+    int i = m_seg_head;
+    int n = 0;
+    for ( ; i < m_seg_count && segs[ i ].base; ++i, ++n ) {
+        iv[ n ].iov_base = ( void* )segs[ i ].base;
+        iv[ n ].iov_len = segs[ i ].len;
+    }
+    struct msghdr msg;
+    memset( &msg, 0, sizeof( msg ) );
+    msg.msg_iov = iv;
+    msg.msg_iovlen = n;
+    return sendmsg( m_sockFd, &msg, i < m_seg_count ? MSG_MORE : 0 );
+}
+
+// 在发送队列末尾加一段，和前一个内存段首尾相接时直接合并
+// 文件内容不在内存里时记下来，这一批响应生成完后先交给I/O线程预读；文件段只看第一个窗口，后面的窗口发送时再查
+void http_conn::add_segment( const char* base, int fd, off_t offset, size_t len, int flags ) {
+    segment* segs = m_buf->segs;
+    bytes_to_send += len;
+    size_t window = len < ( size_t )SEND_WINDOW ? len : SEND_WINDOW;
+    bool warm = true;
+    if ( ( flags & SEG_FILE ) && m_prefetch && !m_cold ) {
+        warm = base ? file_cache::resident( base, len ) : file_cache::resident( fd, offset, window );
+        m_cold = !warm;
+    }
+    if ( base && m_seg_count > 0 ) {
+        segment& last = segs[ m_seg_count - 1 ];
+        if ( last.base && last.base + last.len == base ) {
+            last.len += len;
+            return;
+        }
+    }
+    segment& seg = segs[ m_seg_count++ ];
+    seg.base = base;
+    seg.fd = fd;
+    seg.offset = offset;
+    seg.len = len;
+    seg.dropped = ( flags & SEG_STREAM ) ? offset : -1;
+    seg.warm = ( warm && !m_cold ) ? offset + window : offset;
+}
+
+// 只在epoll后端发送时调用；io_uring后端的splice由内核的工作线程完成，不会阻塞事件循环
+bool http_conn::cold_window() {
+    segment& seg = m_buf->segs[ m_seg_head ];
+    if ( seg.base || seg.offset < seg.warm ) {
         return false;
     }
-    va_list arg_list;
-    va_start( arg_list, format );
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUF_SIZE - 1 - m_write_idx, format, arg_list );
-    if( len >= ( WRITE_BUF_SIZE - 1 - m_write_idx ) ) {
+    size_t window = seg.len < ( size_t )SEND_WINDOW ? seg.len : SEND_WINDOW;
+    if ( !m_prefetch || file_cache::resident( seg.fd, seg.offset, window ) ) {
+        seg.warm = seg.offset + window;
         return false;
     }
-    m_write_idx += len;
-    va_end( arg_list );
     return true;
 }
 
-bool http_conn::add_status_line( int status, const char* title ) {
-    return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
+// 内存段逐页访问(写缓冲等本来就在内存里，很快)，文件段读进每段接下来的一个窗口
+void http_conn::prefetch() {
+    segment* segs = m_buf->segs;
+    for ( int i = m_seg_head; i < m_seg_count; ++i ) {
+        segment& seg = segs[ i ];
+        if ( seg.base ) {
+            file_cache::prefault( seg.base, seg.len );
+        }
+        else if ( seg.offset >= seg.warm ) {
+            size_t window = seg.len < ( size_t )SEND_WINDOW ? seg.len : SEND_WINDOW;
+            file_cache::prefault( seg.fd, seg.offset, window );
+            seg.warm = seg.offset + window;
+        }
+    }
+    m_cold = false;
+    m_loop->hand_back( this, EPOLLOUT );
 }
 
-bool http_conn::add_headers(int content_len) {
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
-}
+int http_conn::classify( http_conn* conn ) {
+    // 已经在解析请求头的请求(上一次没读完)直接按一般的处理
+    if ( conn->m_check_state != CHECK_STATE_REQUESTLINE || !conn->m_readBuf ) {
+        return WORK_NORMAL;
+    }
+
+    // 请求行"GET /index.html HTTP/1.1"：取第一个空格和第二个空格之间的URL，读缓冲以'\0'结尾
+    const char* line = conn->m_readBuf + conn->m_start_line;
+    const char* end = conn->m_readBuf + conn->m_read_index;
+    const char* url = (const char*)memchr( line, ' ', end - line );
+    if ( !url || ++url >= end || *url != '/' ) {
+        return WORK_NORMAL;
+    }
+    const char* url_end = (const char*)memchr( url, ' ', end - url );
+    if ( !url_end ) {
+        return WORK_NORMAL;
+    }
+    size_t url_len = url_end - url;
+
+    if ( url_len == strlen( STATS_URL ) && memcmp( url, STATS_URL, url_len ) == 0 ) {
+        return WORK_FAST;
+    }
 
-bool http_conn::add_content_length(int content_len) {
-    return add_response( "Content-Length: %d\r\n", content_len );
+    const bundle_entry* entry = static_bundle::instance()->find( url, url_len );
+    if ( entry ) {
+        return entry->body_len <= (uint64_t)SMALL_WORK ? WORK_FAST : WORK_NORMAL;
+    }
+
+    // 不在包里的文件不查文件缓存(要加缓存的锁)，按这个连接上一个请求的工作量估计
+    return conn->m_work;
 }
 
-bool http_conn::add_linger()
-{
-    return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
+void http_conn::prefetch_task::process() {
+    conn->prefetch();
 }
 
-bool http_conn::add_blank_line()
-{
-    return add_response( "%s", "\r\n" );
+// 发送了bytes字节，跳过发完的段，部分发送的段从断点继续
+// 文件段的offset已经由sendfile(或者io_uring后端)推进过了
+void http_conn::advance( size_t bytes ) {
+    metrics_add( CNT_BYTES_SENT, bytes );
+    segment* segs = m_buf->segs;
+    while ( bytes > 0 ) {
+        segment& seg = segs[ m_seg_head ];
+        size_t step = bytes < seg.len ? bytes : seg.len;
+        if ( seg.base ) {
+            seg.base += step;
+        }
+        seg.len -= step;
+        bytes -= step;
+        // 大文件发送过的部分不会很快再用到，每满一个窗口就让内核丢掉这些页，页缓存的占用不随文件变大
+        if ( seg.dropped >= 0 && ( seg.offset - seg.dropped >= SEND_WINDOW || seg.len == 0 ) ) {
+            posix_fadvise( seg.fd, seg.dropped, seg.offset - seg.dropped, POSIX_FADV_DONTNEED );
+            seg.dropped = seg.offset;
+        }
+        if ( seg.len == 0 ) {
+            ++m_seg_head;
+        }
+    }
 }
 
-bool http_conn::add_content( const char* content )
-{
-    return add_response( "%s", content );
+// 往写缓冲中写入响应头：拷贝状态行和固定头部的模板，只格式化Content-Length
+// extra是Content-Length之后额外的头部，如文件的验证头部
+bool http_conn::add_headers( HTTP_STATUS status, CONTENT_TYPE type, off_t content_length, const char* extra, int extra_len ) {
+    const response_tpl& head = g_status_head[ status ];
+    const response_tpl& tail = g_header_tail[ type ][ m_linger ];
+    if ( m_write_idx + head.len + 22 + extra_len + tail.len > WRITE_BUF_SIZE ) {
+        return false;
+    }
+    char* p = m_write_buf + m_write_idx;
+    memcpy( p, head.data, head.len );
+    p += head.len;
+    p += format_uint( p, content_length );
+    *p++ = '\r';
+    *p++ = '\n';
+    memcpy( p, extra, extra_len );
+    p += extra_len;
+    memcpy( p, tail.data, tail.len );
+    p += tail.len;
+    m_write_idx = p - m_write_buf;
+    return true;
 }
 
-bool http_conn::add_content_type() {
-    return add_response("Content-Type:%s\r\n", "text/html");
+// 按m_buf->ranges发送文件的一部分：一个区间时响应体就是那一段，多个区间时拼成multipart/byteranges
+// 各部分的头部写在写缓冲里，内容直接引用映射中的区间(addr)或者描述符从fd_offset起的区间，不拷贝，
+// 映射中不在区间里的页不会被访问
+bool http_conn::add_ranges( const char* addr, int fd, off_t fd_offset, off_t size, CONTENT_TYPE type, const char* validators, int validators_len, bool stream ) {
+    byte_range* ranges = m_buf->ranges;
+    int start = m_write_idx;
+    int part_len[ MAX_RANGES ];     // 多个区间时各部分头部的长度，头部在写缓冲中依次相接
+    const char* part = NULL;
+    m_status = STATUS_206;
+
+    if ( m_range_count == 1 ) {
+        char extra[ VALIDATORS_LEN + 80 ];
+        memcpy( extra, validators, validators_len );
+        int extra_len = validators_len + snprintf( extra + validators_len, sizeof( extra ) - validators_len,
+                "Content-Range: bytes %lld-%lld/%lld\r\n", (long long)ranges[ 0 ].first, (long long)ranges[ 0 ].last, (long long)size );
+        if ( !add_headers( STATUS_206, type, ranges[ 0 ].last - ranges[ 0 ].first + 1, extra, extra_len ) ) {
+            return false;
+        }
+        add_segment( m_write_buf + start, -1, 0, m_write_idx - start );
+    }
+    else {
+        // 先生成各部分的头部，算出整个响应体的长度
+        char parts[ MAX_RANGES * PART_HEADER_LEN ];
+        int parts_len = 0;
+        off_t content_length = g_multipart_end.len;
+        for ( int i = 0; i < m_range_count; ++i ) {
+            part_len[ i ] = format_part_header( parts + parts_len, type, ranges[ i ].first, ranges[ i ].last, size );
+            parts_len += part_len[ i ];
+            content_length += part_len[ i ] + ranges[ i ].last - ranges[ i ].first + 1;
+        }
+        if ( !add_headers( STATUS_206, TYPE_MULTIPART, content_length, validators, validators_len )
+            || m_write_idx + parts_len > WRITE_BUF_SIZE ) {
+            return false;
+        }
+        part = m_write_buf + m_write_idx;
+        memcpy( m_write_buf + m_write_idx, parts, parts_len );
+        m_write_idx += parts_len;
+        // 响应头和第一个部分的头部相接，合成一段
+        add_segment( m_write_buf + start, -1, 0, part - m_write_buf - start + part_len[ 0 ] );
+        part += part_len[ 0 ];
+    }
+
+    for ( int i = 0; i < m_range_count; ++i ) {
+        if ( i > 0 ) {
+            add_segment( part, -1, 0, part_len[ i ] );
+            part += part_len[ i ];
+        }
+        off_t len = ranges[ i ].last - ranges[ i ].first + 1;
+        if ( addr ) {
+            add_segment( addr + ranges[ i ].first, -1, 0, len, SEG_FILE );
+        }
+        else {
+            add_segment( NULL, fd, fd_offset + ranges[ i ].first, len, SEG_FILE | ( stream ? SEG_STREAM : 0 ) );
+        }
+    }
+    if ( m_range_count > 1 ) {
+        add_segment( g_multipart_end.data, -1, 0, g_multipart_end.len );
+    }
+    return true;
 }
 
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
+// 响应追加在发送队列的末尾，排在同一批前面请求的响应之后
 bool http_conn::process_write(HTTP_CODE ret) {
+    HTTP_STATUS status;
     switch (ret)
     {
         case INTERNAL_ERROR:
-            add_status_line( 500, error_500_title );
-            add_headers( strlen( error_500_form ) );
-            if ( ! add_content( error_500_form ) ) {
-                return false;
-            }
+            status = STATUS_500;
             break;
         case BAD_REQUEST:
-            add_status_line( 400, error_400_title );
-            add_headers( strlen( error_400_form ) );
-            if ( ! add_content( error_400_form ) ) {
-                return false;
-            }
+            // 找不到下一个请求的开头了，发完这个响应就关闭连接
+            m_linger = false;
+            status = STATUS_400;
             break;
         case NO_RESOURCE:
-            add_status_line( 404, error_404_title );
-            add_headers( strlen( error_404_form ) );
-            if ( ! add_content( error_404_form ) ) {
-                return false;
-            }
+            status = STATUS_404;
             break;
         case FORBIDDEN_REQUEST:
-            add_status_line( 403, error_403_title );
-            add_headers(strlen( error_403_form));
-            if ( ! add_content( error_403_form ) ) {
+            status = STATUS_403;
+            break;
+        case FILE_REQUEST: {
+            m_status = STATUS_200;
+            int start = m_write_idx;    // 这个响应头在写缓冲中的起始位置
+            // 压缩版本的内容在映射(或后台压缩的内存)里，sendfile方式下预压缩文件没有映射，用它的描述符
+            const char* addr = m_file_address;
+            int fd = m_file->fd;
+            off_t size = m_file->st.st_size;
+            const char* validators = m_file->validators;
+            int validators_len = m_file->validators_len;
+            if ( m_variant ) {
+                addr = m_variant->addr;
+                fd = m_variant->fd;
+                size = m_variant->size;
+                validators = m_variant->validators;
+                validators_len = m_variant->validators_len;
+            }
+            if ( m_range_count > 0 ) {
+                if ( !add_ranges( addr, fd, 0, size, m_file->type, validators, validators_len, m_file->stream && !m_variant ) ) {
+                    return false;
+                }
+            }
+            else {
+                if ( !add_headers( STATUS_200, m_file->type, size, validators, validators_len ) ) {
+                    return false;
+                }
+                add_segment( m_write_buf + start, -1, 0, m_write_idx - start );
+                if ( size > 0 ) {
+                    if ( addr ) {
+                        add_segment( addr, -1, 0, size, SEG_FILE );
+                    }
+                    else {
+                        add_segment( NULL, fd, 0, size, SEG_FILE | ( m_file->stream && !m_variant ? SEG_STREAM : 0 ) );
+                    }
+                }
+            }
+            // 文件条目要等整批响应发送完才能释放
+            m_buf->files[ m_file_count++ ] = m_file;
+            m_file = 0;
+            m_file_address = 0;
+            return true;
+        }
+        case BUNDLE_REQUEST: {
+            // 响应头和文件内容都在映像里，写缓冲中什么也不用写
+            // 保持连接的响应头紧挨着文件内容，writev方式下两段会合成一段
+            static_bundle* bundle = static_bundle::instance();
+            if ( m_range_count > 0 ) {
+                // 区间响应的头部在写缓冲里现拼，内容仍然引用映像
+                const char* addr = m_transmit == TRANSMIT_SENDFILE ? NULL : bundle->base() + m_entry->body;
+                return add_ranges( addr, bundle->fd(), m_entry->body, m_entry->body_len, (CONTENT_TYPE)m_entry->type,
+                        bundle->base() + m_entry->validators, m_entry->validators_len );
+            }
+            m_status = STATUS_200;
+            add_segment( bundle->base() + m_entry->head[ m_linger ], -1, 0, m_entry->head_len[ m_linger ] );
+            if ( m_entry->body_len > 0 ) {
+                if ( m_transmit == TRANSMIT_SENDFILE ) {
+                    add_segment( NULL, bundle->fd(), m_entry->body, m_entry->body_len, SEG_FILE );
+                }
+                else {
+                    add_segment( bundle->base() + m_entry->body, -1, 0, m_entry->body_len, SEG_FILE );
+                }
+            }
+            return true;
+        }
+        case NOT_MODIFIED: {
+            m_status = STATUS_304;
+            if ( m_entry ) {
+                // 静态资源包里的304响应也是预先生成好的
+                add_segment( static_bundle::instance()->base() + m_entry->not_modified[ m_linger ], -1, 0, m_entry->not_modified_len[ m_linger ] );
+                return true;
+            }
+            // 状态行、文件的验证头部和Connection拼在写缓冲里，文件条目马上释放
+            const response_tpl& tail = g_connection_tail[ m_linger ];
+            const char* validators = m_variant ? m_variant->validators : m_file->validators;
+            int validators_len = m_variant ? m_variant->validators_len : m_file->validators_len;
+            int len = g_not_modified.len + validators_len + tail.len;
+            if ( m_write_idx + len > WRITE_BUF_SIZE ) {
                 return false;
             }
-            break;
-        case FILE_REQUEST:
-            add_status_line(200, ok_200_title );
-            add_headers(m_file_stat.st_size);
-            m_iv[ 0 ].iov_base = m_write_buf;
-            m_iv[ 0 ].iov_len = m_write_idx;
-            m_iv[ 1 ].iov_base = m_file_address;
-            m_iv[ 1 ].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
-
-            bytes_to_send = m_write_idx + m_file_stat.st_size;
-
+            char* p = m_write_buf + m_write_idx;
+            memcpy( p, g_not_modified.data, g_not_modified.len );
+            memcpy( p + g_not_modified.len, validators, validators_len );
+            memcpy( p + g_not_modified.len + validators_len, tail.data, tail.len );
+            add_segment( p, -1, 0, len );
+            m_write_idx += len;
+            file_cache::instance()->release( m_file );
+            m_file = 0;
             return true;
+        }
+        case RANGE_NOT_SATISFIABLE: {
+            // 416带上当前版本的长度，客户端可以据此重新请求
+            m_status = STATUS_416;
+            off_t size = m_entry ? (off_t)m_entry->body_len : ( m_variant ? m_variant->size : m_file->st.st_size );
+            char extra[ 64 ];
+            int extra_len = snprintf( extra, sizeof( extra ), "Content-Range: bytes */%lld\r\n", (long long)size );
+            int start = m_write_idx;
+            if ( !add_headers( STATUS_416, TYPE_PLAIN, 0, extra, extra_len ) ) {
+                return false;
+            }
+            add_segment( m_write_buf + start, -1, 0, m_write_idx - start );
+            if ( m_file ) {
+                file_cache::instance()->release( m_file );
+                m_file = 0;
+            }
+            return true;
+        }
+        case STATS_REQUEST: {
+            // 报告在内存中生成，一批里有多个这样的请求时共用同一份
+            if ( !m_stats ) {
+                m_stats = (char*)malloc( STATS_BUF_SIZE );
+                if ( !m_stats ) {
+                    return false;
+                }
+                m_stats_len = metrics_render( m_stats, STATS_BUF_SIZE );
+            }
+            m_status = STATUS_200;
+            int start = m_write_idx;
+            if ( !add_headers( STATUS_200, TYPE_PLAIN, m_stats_len ) ) {
+                return false;
+            }
+            add_segment( m_write_buf + start, -1, 0, m_write_idx - start );
+            add_segment( m_stats, -1, 0, m_stats_len );
+            return true;
+        }
         default:
             return false;
     }
 
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
-    bytes_to_send = m_write_idx;
+    // 错误响应是预先生成好的静态数据，直接放进发送队列
+    m_status = status;
+    const response_tpl& error = g_error_response[ status ][ m_linger ];
+    add_segment( error.data, -1, 0, error.len );
     return true;
 }
 
 //由线程池工作线程调用，处理HTTP请求的入口函数
+//读缓冲区里可能有流水线上的多个请求，依次解析并生成响应，最后一起发送
 void http_conn::process(){
-    // 解析HTTP请求
-    HTTP_CODE read_ret = process_read();
-    if ( read_ret == NO_REQUEST ) {
-        modFd( m_epollFd, m_sockFd, EPOLLIN );
+    uint64_t waited = metrics_now() - m_dispatch_ns;
+    metrics_record( STAGE_QUEUE, waited );
+    m_resume = false;
+
+    // 排队太久的请求客户端多半已经放弃或重试了，不再解析，尽快腾出线程给新请求
+    if ( m_queue_deadline > 0 && waited > (uint64_t)m_queue_deadline * 1000000 ) {
+        shed();
         return;
     }
-    
-    // 生成响应
-    bool write_ret = process_write( read_ret );
-    if ( !write_ret ) {
-        close_conn();
+
+    int served = 0;
+    bool keep = true;
+    while ( served < MAX_PIPELINE ) {
+        // 写缓冲或发送队列不够再放一个响应了，剩下的请求等这一批发完再处理
+        if ( served > 0 && ( WRITE_BUF_SIZE - m_write_idx < RESPONSE_RESERVE || MAX_SEGMENTS - m_seg_count < RANGE_SEGMENTS ) ) {
+            break;
+        }
+
+        // 解析HTTP请求
+        uint64_t begin = metrics_now();
+        HTTP_CODE read_ret = process_read();
+        if ( read_ret == NO_REQUEST ) {
+            break;
+        }
+        uint64_t parsed = metrics_now();
+        metrics_record( STAGE_PARSE, parsed - begin );
+
+        // 请求完整了，取得目标文件
+        if ( read_ret == GET_REQUEST ) {
+            read_ret = do_request();
+            metrics_record( STAGE_OPEN, metrics_now() - parsed );
+        }
+
+        // 生成响应
+        off_t queued = bytes_to_send;
+        if ( !process_write( read_ret ) ) {
+            keep = false;
+            break;
+        }
+        log_access( bytes_to_send - queued );
+        metrics_response( m_status );
+        ++served;
+
+        // 请求要求关闭连接，或者格式错误以致找不到下一个请求的开头，后面的数据都不再处理
+        if ( !m_linger ) {
+            keep = false;
+            break;
+        }
+        next_request();
+    }
+
+    if ( served == 0 ) {
+        if ( keep ) {
+            // 请求还不完整，继续读
+            m_loop->hand_back( this, EPOLLIN );
+        }
+        else {
+            // 连接和它的定时器只能由所属的事件循环关闭，这里关掉socket让循环收到EPOLLHUP
+            shutdown( m_sockFd, SHUT_RDWR );
+            m_loop->hand_back( this, EPOLLOUT );
+        }
+        return;
+    }
+
+    m_keep_alive = keep;
+    if ( keep ) {
+        compact();
+    }
+    m_send_ns = metrics_now();
+    // 要发送的文件内容有不在内存里的，先交给I/O线程读进来，事件循环发送时不会阻塞在磁盘上
+    // 连接在I/O线程池里期间m_busy不减，定时器到期也不会关闭它
+    if ( m_cold && m_prefetch( &m_prefetch_task ) ) {
+        metrics_add( CNT_PREFETCHES );
+        return;
+    }
+    // 交回事件循环，m_busy由事件循环取回时减一：这之前定时器不会关掉连接，这之后工作线程不再访问它
+    m_loop->hand_back( this, EPOLLOUT );
+}
+
+// 访问日志：客户端地址 fd "请求目标" 状态码 响应字节数
+void http_conn::log_access( off_t bytes ) {
+    // io_uring的多次accept拿不到对端地址，第一次写日志时再查一次
+    if ( m_address.sin_family == 0 ) {
+        socklen_t len = sizeof( m_address );
+        getpeername( m_sockFd, (sockaddr*)&m_address, &len );
+    }
+    char ip[ INET_ADDRSTRLEN ];
+    inet_ntop( AF_INET, &m_address.sin_addr, ip, sizeof( ip ) );
+    LOG_ACCESS( "%s:%d fd=%d \"GET %s\" %d %lld", ip, ntohs( m_address.sin_port ), m_sockFd,
+                m_url ? m_url : "-", status_code( m_status ), ( long long )bytes );
+}
+
+void http_conn::shed() {
+    const response_tpl& busy = g_error_response[ STATUS_503 ][ 0 ];
+    add_segment( busy.data, -1, 0, busy.len );
+    m_keep_alive = false;
+    metrics_response( STATUS_503 );
+    metrics_add( CNT_SHED_STALE );
+    m_send_ns = metrics_now();
+    m_loop->hand_back( this, EPOLLOUT );
+}
+
+// 由事件循环调用，读到的请求不再处理；503写不进socket也不等
+void http_conn::reject() {
+    --m_busy;
+    const response_tpl& busy = g_error_response[ STATUS_503 ][ 0 ];
+    send( m_sockFd, busy.data, busy.len, MSG_DONTWAIT | MSG_NOSIGNAL );
+    metrics_response( STATUS_503 );
+    close_conn();
+}
+
+// 定时器到期，由所属的事件循环调用
+void http_conn::expire() {
+    if ( m_busy > 0 ) {
+        // 还在线程池中，等下一个tick再检查
+        m_timers->add( &m_timer, m_timers->tickMs(), m_timer.type );
+        return;
     }
-    modFd( m_epollFd, m_sockFd, EPOLLOUT);
+    LOG_INFO( "close idle connection %d, timer type %d", m_sockFd, m_timer.type );
+    metrics_add( CNT_TIMEOUTS );
+    close_conn();
 }
\ No newline at end of file
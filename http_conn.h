@@ -16,19 +16,99 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
-#include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
+#include "file_cache.h"
+#include "static_bundle.h"
+#include "timer_wheel.h"
+#include "slab_pool.h"
+#include "http_scan.h"
+#include "http_response.h"
+#include "io_backend.h"
+#include "log.h"
+#include "metrics.h"
+#include "work_queue.h"
 #include <sys/uio.h>
+#include <atomic>
 
-class http_conn {
+class alignas(CACHE_LINE_SIZE) http_conn {
 public:
-    static int m_epollFd; //所有socket上事件都被注册到同一个epoll文件描述符中
-    static int m_userCnt; //统计用户数量
+    static padded_atomic<int> m_userCnt; //统计用户数量，多个事件循环线程都会修改，独占一个缓存行
+
+    // 文件内容的发送方式，启动时选定
+    // TRANSMIT_WRITEV   : 响应头和mmap映射的文件一起writev
+    // TRANSMIT_SENDFILE : 响应头用send(MSG_MORE)发送，文件内容用sendfile从缓存的描述符零拷贝发送
+    enum TRANSMIT_MODE { TRANSMIT_WRITEV = 0, TRANSMIT_SENDFILE };
+    static TRANSMIT_MODE m_transmit;
+
+    // 请求在线程池队列里等待的最长时间，单位毫秒，超过了不再处理，直接回503；0为不限制
+    static int m_queue_deadline;
+
+    // I/O线程池的任务：把连接要发送的文件内容读进内存后再交给事件循环发送，线程池调用process()
+    struct prefetch_task {
+        http_conn * conn;
+        void process();
+    };
+
+    // 把预读任务交给I/O线程池，队列满时返回false，由main设置；NULL时不检查文件内容是否在内存里
+    static bool (*m_prefetch)( prefetch_task * task );
+
+    // 请求预计的工作量，优先级队列按它分通道，小的先处理
+    // WORK_FAST  : 运行统计、包里的小文件
+    // WORK_NORMAL: 包里的大文件、还没读完请求行的请求、新连接的第一个请求
+    // WORK_SLOW  : 不存在或打不开的文件，处理时要stat，404也在这里
+    // 不在包里的文件不查文件缓存，按同一个连接上一个请求的结果估计
+    enum WORK_CLASS { WORK_FAST = 0, WORK_NORMAL, WORK_SLOW };
+    static const int SMALL_WORK = 64 * 1024;    // 不超过这个大小的文件算小文件
+
+    // 按读到的请求行估计工作量，在事件循环线程交给线程池时调用，只读请求行和m_work，不加锁
+    static int classify( http_conn * conn );
 
     static const int FILENAME_LEN = 200;        // 文件名的最大长度
     static const int READ_BUF_SIZE = 2048;
-    static const int WRITE_BUF_SIZE = 2048;
+    static const int WRITE_BUF_SIZE = 8192;
+
+    // HTTP/1.1流水线：一次读到的多个请求在一批里处理，所有响应合在一起发送
+    static const int MAX_PIPELINE = 16;             // 一批最多处理的请求数，剩下的等这一批发完再处理
+    static const int RANGE_SEGMENTS = 2 * MAX_RANGES + 1;  // 多个区间的响应最多的段数：每个部分的头部和内容，加上结尾的分隔符
+    static const int MAX_SEGMENTS = 2 * MAX_PIPELINE + RANGE_SEGMENTS;  // 一般的响应最多两段：响应头和文件内容
+    static const int RESPONSE_RESERVE = 2304;       // 写缓冲剩余空间不够一个响应(最多的是多个区间的响应头)时，留到下一批
+    static const int STATS_BUF_SIZE = 4096;         // 运行统计报告的最大长度
+    static const int SEND_WINDOW = 1 << 20;         // 一次EPOLLOUT最多发送的字节数，大文件发送过的部分按这个粒度从页缓存中丢掉
+
+    // 待发送的一段数据，可以是内存中的一段(响应头、错误页面、mmap的文件)，也可以是用sendfile发送的文件区间
+    struct segment {
+        const char * base;  // 内存段下一个要发送的位置，文件段为NULL
+        int fd;             // 文件段的描述符
+        off_t offset;       // 文件段下一个要发送的位置，由sendfile推进
+        size_t len;         // 还没发送的字节数
+        off_t dropped;      // 大文件的段从这里起的页缓存还没有丢掉，其他段为-1
+        off_t warm;         // 文件段从offset到这里已经确认在页缓存里，sendfile不会越过它
+    };
+
+    // 段的性质
+    enum SEGMENT_FLAG {
+        SEG_FILE = 1,       // 文件内容，发送前要确认在内存里
+        SEG_STREAM = 2      // 大文件的内容，发送过的部分从页缓存中丢掉
+    };
+
+    // 读写缓冲区、文件路径和这一批响应的发送队列，只在读写请求期间从slab内存池借来，连接空闲时归还
+    struct buffers {
+        char read[ READ_BUF_SIZE ];
+        char write[ WRITE_BUF_SIZE ];
+        char file[ FILENAME_LEN ];
+        segment segs[ MAX_SEGMENTS ];           // 按顺序发送的数据段
+        file_entry * files[ MAX_PIPELINE ];     // 这一批响应引用的文件缓存条目，发送完后释放
+        byte_range ranges[ MAX_RANGES ];        // 当前请求要发送的区间
+        struct msghdr msg;                      // io_uring异步发送期间内核要读取的msghdr和iovec
+        struct iovec iv[ MAX_SEGMENTS ];
+    };
+
+    // 连接的三种期限，单位毫秒
+    static const int HEADER_TIMEOUT = 10000;    // 从请求的第一个字节(或连接建立)起，读完请求头的期限
+    static const int IDLE_TIMEOUT = 60000;      // 长连接两次请求之间的空闲期限
+    static const int WRITE_TIMEOUT = 30000;     // 发送响应时对方一直不接收数据的期限
+    enum TIMER_TYPE { TIMER_HEADER = 0, TIMER_IDLE, TIMER_WRITE };
 
     // HTTP请求方法，这里只支持GET
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT}; 
@@ -49,23 +129,34 @@ public:
         NO_RESOURCE         :   表示服务器没有资源
         FORBIDDEN_REQUEST   :   表示客户对资源没有足够的访问权限
         FILE_REQUEST        :   文件请求,获取文件成功
+        BUNDLE_REQUEST      :   请求的文件在静态资源包里
+        NOT_MODIFIED        :   条件请求的文件没有变化，回304，不发送内容
+        RANGE_NOT_SATISFIABLE   :   请求的区间都在文件之外，回416
+        STATS_REQUEST       :   请求的是运行统计的报告
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, BUNDLE_REQUEST, NOT_MODIFIED, RANGE_NOT_SATISFIABLE, STATS_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
     
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
 
-    http_conn(){}
+    http_conn() : m_sockFd(-1), m_buf(NULL), m_file(NULL), m_file_address(NULL), m_file_count(0), m_stats(NULL) {}
     ~http_conn(){}
 
     void process(); // 处理客户端的请求
-    void init(int sockFd, const sockaddr_in & addr); //初始化新接收的对象
-    void close_conn(); //关闭连接
+    void init(int sockFd, const sockaddr_in & addr, io_backend * loop); //初始化新接收的对象，loop为接收它的事件循环
+    void close_conn(); //关闭连接，由所属的事件循环决定什么时候真正关闭
+    void release(); //释放连接占用的资源并关闭socket，由事件后端调用
+    int fd() { return m_sockFd; }
     bool read(); //非阻塞的读
+    bool feed(const char * data, int len); //放入后端已经收到的数据，用于io_uring这类由内核完成读取的后端
     bool write(); //非阻塞的写
+    bool pipelined() { return m_resume; } //write()发完一批响应后缓冲区里还有请求，需要再交给线程池
+    void returned() { m_busy.fetch_sub( 1, std::memory_order_relaxed ); } //事件循环从收件箱取回了工作线程交回的连接
+    void expire(); //定时器到期
+    void reject(); //线程池满了，由事件循环直接回503并关闭连接
     
     // HTTP_CODE process_read();
     // HTTP_CODE parse_request_line(char * text);
@@ -75,54 +166,106 @@ public:
     // LINE_STATUS parse_line();
 
 private:
-    int m_sockFd; //该http连接的socket
-    sockaddr_in m_address; //通信的socket地址
+    // 成员按访问的频率和线程分组：对象按缓存行对齐，users数组里相邻的连接不会共用缓存行；
+    // 事件循环每次读写都要访问的放在开头的两个缓存行里，解析和生成响应的状态在后面，
+    // 很少用到的放在最后，读写缓冲区和发送队列在借来的m_buf里，不在对象中
 
-    char m_readBuf[READ_BUF_SIZE];
+    // 事件循环的读写路径，第一个缓存行
+    int m_sockFd; //该http连接的socket
     int m_read_index;          //标志缓冲区中读入客户端数据最后一个字节的下一个位置
+    io_backend * m_loop; //该连接所属的事件循环，连接在其生命周期内一直留在这个循环上
+    timer_wheel * m_timers; //所属事件循环的时间轮，只在该循环线程中操作
+    buffers * m_buf;           //当前借用的缓冲区，连接空闲时为NULL
+    char * m_readBuf;          //读缓冲区，指向m_buf->read
+    off_t bytes_to_send;            // 将要发送的数据的字节数，大文件可以超过2GB
+    off_t bytes_have_send;          // 已经发送的字节数
+    int m_seg_head;                         // 发送队列中第一个还没发完的段
+    int m_seg_count;                        // 发送队列中的段数
+
+    // 第二个缓存行：定时器、工作线程和事件循环交接的状态，以及io_uring后端的状态(只在所属事件循环线程中访问)
+    std::atomic<int> m_busy; //在线程池中排队或处理的次数，不为0时定时器到期也不能关闭连接
+    int m_inflight;                         // 已经提交、还没完成的操作数
+    int m_pipe[2];                          // 用splice发送文件内容的管道，第一次需要时创建
+    int m_pipe_bytes;                       // 管道中还没发到socket的字节数
+    bool m_closing;                         // 已经shutdown，等操作全部完成后再关闭
+    bool m_keep_alive;                      // 这一批响应发完后是否保持连接
+    bool m_resume;                          // 读缓冲区中还有流水线上的请求等待处理
+    bool m_cold;                            // 这一批响应的文件内容有不在内存里的，要先交给I/O线程预读
+    timer_node m_timer;     //当前生效的期限(请求头/空闲/发送)，同一时刻只有一个
+    friend class uring_backend;
+
+    uint64_t m_dispatch_ns;                 // 交给线程池的时刻
+    uint64_t m_send_ns;                     // 这一批响应生成好的时刻
+
+    // 工作线程解析请求、生成响应时的状态
     int m_checked_index;       //当前正在分析的字符在读缓冲区的位置
     int m_start_line;          //当前正在解析的行的起始位置
+    int m_request_start;       //当前请求在读缓冲区中的起始位置，之前的数据属于已经处理完的请求
+    CHECK_STATE m_check_state; //主状态机当前所处的状态
     char *m_url;               //请求目标文件的文件名
     char *m_version;           //协议版本，只支持HTTP1.1
-    CHECK_STATE m_check_state; //主状态机当前所处的状态
     METHOD m_method;           //请求方法
-    char * m_host;             //主机名
     int m_content_length;      //请求的消息总长度
+    char * m_host;             //主机名
+    char * m_if_none_match;    //If-None-Match的值，没有为NULL
+    char * m_if_modified_since;    //If-Modified-Since的值，没有为NULL
+    char * m_range;            //Range的值，没有为NULL
+    char * m_if_range;         //If-Range的值，没有为NULL
+    unsigned m_accept_encoding;    //Accept-Encoding中可以接受的编码，按位表示
+    int m_range_count;         //要发送的区间数，0为整个文件
     bool m_linger;             //是否保持连接
-
-    char m_real_file[ FILENAME_LEN ];       // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
-    char m_write_buf[ WRITE_BUF_SIZE ];     // 写缓冲区
+    HTTP_STATUS m_status;      //最近一个响应的状态码，写访问日志用
+    int m_work;                //最近一个文件请求的工作量(WORK_CLASS)，下一次交给线程池时分类用
     int m_write_idx;                        // 写缓冲区中待发送的字节数
-    char* m_file_address;                   // 客户请求的目标文件被mmap到内存中的起始位置
-    struct stat m_file_stat;                // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
-    struct iovec m_iv[2];                   // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
-    int m_iv_count;
+    char* m_write_buf;                      // 写缓冲区，指向m_buf->write
+    char* m_real_file;                      // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录，指向m_buf->file
+    file_entry* m_file;                     // 从文件缓存中取得的目标文件条目，文件的状态也在里面，响应发送完后释放
+    char* m_file_address;                   // 客户请求的目标文件被mmap到内存中的起始位置，由文件缓存持有
+    file_variant* m_variant;                // 按Accept-Encoding选中的压缩版本，NULL为发送原文件；随m_file一起释放
+    const bundle_entry* m_entry;            // 静态资源包中的目标文件(或它的压缩版本)，映像一直映射着，不需要释放
+    int m_file_count;                       // 这一批响应引用的文件条目数
+    int m_stats_len;
+    char* m_stats;                          // 这一批响应中的运行统计报告，发送完后释放
 
-    int bytes_to_send;              // 将要发送的数据的字节数
-    int bytes_have_send;            // 已经发送的字节数
+    // 很少用到的
+    sockaddr_in m_address; //通信的socket地址，写访问日志时才用
+    prefetch_task m_prefetch_task;
+
+    // 微基准(bench/micro_bench.cpp)直接调用私有的解析和响应函数
+    friend struct conn_bench;
 
     void init();    // 初始化连接
+    void next_request();    // 一个请求处理完，为解析流水线上的下一个请求重置状态
+    void compact();     // 把还没处理完的数据挪到读缓冲区开头
+    bool attach_buf();  // 从内存池借缓冲区
+    bool read_done( bool fresh );   // 读到数据之后的处理，fresh表示读之前缓冲区是空的
+    bool write_done();  // 一批响应发送完之后的处理，返回false表示要关闭连接
+    void detach_buf();  // 归还缓冲区
     HTTP_CODE process_read();    // 解析HTTP请求
     bool process_write( HTTP_CODE ret );    // 填充HTTP应答
+    void log_access( off_t bytes );   // 为刚生成的响应写一行访问日志
+    void shed();    // 排队太久的请求，不处理直接回503
 
     // 下面这一组函数被process_read调用以分析HTTP请求
-    HTTP_CODE parse_request_line( char* text );   //解析请求首行
-    HTTP_CODE parse_headers( char* text );        //解析请求头
-    HTTP_CODE parse_content( char* text );        //解析请求体
-    HTTP_CODE do_request();
+    HTTP_CODE parse_request_line( char* text, int len );   //解析请求首行
+    HTTP_CODE parse_headers( char* text, int len );        //解析请求头
+    HTTP_CODE parse_content();        //跳过请求体
+    HTTP_CODE do_request();     // 请求完整之后由process调用，取得目标文件
+    bool not_modified( const char* etag, int etag_len, time_t mtime );  // 条件请求的验证器和文件一致，可以回304
+    int select_ranges( off_t size, const char* etag, int etag_len, time_t mtime );  // 解析Range，返回区间数，-1为不能满足
     char* get_line() { return m_readBuf + m_start_line; }
     LINE_STATUS parse_line();
 
+    ssize_t transmit(); // 按m_transmit选定的方式发送一次数据
+    void add_segment( const char* base, int fd, off_t offset, size_t len, int flags = 0 );   // 在发送队列末尾加一段，flags为SEGMENT_FLAG的组合
+    bool cold_window();     // 队首的文件段下一个窗口是否还不在页缓存里
+    void prefetch();        // 在I/O线程里把发送队列中的文件内容读进内存，然后交给事件循环发送
+    void advance( size_t bytes );   // 发送了bytes字节，推进发送队列
+
     // 这一组函数被process_write调用以填充HTTP应答。
     void unmap();
-    bool add_response( const char* format, ... );
-    bool add_content( const char* content );
-    bool add_content_type();
-    bool add_status_line( int status, const char* title );
-    bool add_headers( int content_length );
-    bool add_content_length( int content_length );
-    bool add_linger();
-    bool add_blank_line();
+    bool add_headers( HTTP_STATUS status, CONTENT_TYPE type, off_t content_length, const char* extra = NULL, int extra_len = 0 );
+    bool add_ranges( const char* addr, int fd, off_t fd_offset, off_t size, CONTENT_TYPE type, const char* validators, int validators_len, bool stream = false );
 };
 
 
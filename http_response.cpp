@@ -0,0 +1,414 @@
+#include "http_response.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// 定义HTTP响应的一些状态信息
+static const struct {
+    int code;
+    const char * title;
+    const char * form;      //错误页面，200没有
+    const char * extra;     //错误响应额外的头部字段
+} s_status[ STATUS_COUNT ] = {
+    { 200, "OK", NULL, "" },
+    { 206, "Partial Content", NULL, "" },
+    { 304, "Not Modified", NULL, "" },
+    { 400, "Bad Request", "Your request has bad syntax or is inherently impossible to satisfy.\n", "" },
+    { 403, "Forbidden", "You do not have permission to get file from this server.\n", "" },
+    { 404, "Not Found", "The requested file was not found on this server.\n", "" },
+    { 416, "Range Not Satisfiable", NULL, "" },
+    { 500, "Internal Error", "There was an unusual problem serving the requested file.\n", "" },
+    { 503, "Service Unavailable", "The server is overloaded, please retry later.\n", "Retry-After: 1\r\n" },
+};
+
+static const char * s_types[ TYPE_COUNT ] = {
+    "text/html; charset=utf-8",
+    "text/plain; charset=utf-8",
+    "text/css; charset=utf-8",
+    "application/javascript; charset=utf-8",
+    "application/json",
+    "application/xml",
+    "image/svg+xml",
+    "image/jpeg",
+    "image/png",
+    "image/gif",
+    "image/webp",
+    "image/x-icon",
+    "font/woff2",
+    "application/octet-stream",
+    NULL,   //multipart/byteranges，分隔符在启动时生成
+};
+
+//扩展名到Content-Type，不区分大小写
+static const struct {
+    const char * ext;
+    CONTENT_TYPE type;
+} s_extensions[] = {
+    { "html", TYPE_HTML }, { "htm", TYPE_HTML }, { "txt", TYPE_PLAIN }, { "css", TYPE_CSS },
+    { "js", TYPE_JS }, { "mjs", TYPE_JS }, { "json", TYPE_JSON }, { "xml", TYPE_XML }, { "svg", TYPE_SVG },
+    { "jpg", TYPE_JPEG }, { "jpeg", TYPE_JPEG }, { "png", TYPE_PNG }, { "gif", TYPE_GIF },
+    { "webp", TYPE_WEBP }, { "ico", TYPE_ICO }, { "woff2", TYPE_WOFF2 },
+};
+
+const char * g_encoding_suffix[ ENC_COUNT ] = { "", ".gz", ".br" };
+static const char * s_encoding_names[ ENC_COUNT ] = { "identity", "gzip", "br" };
+static const char * s_etag_suffix[ ENC_COUNT ] = { "", "-gz", "-br" };
+
+static const char * s_connection[ 2 ] = { "close", "keep-alive" };
+
+response_tpl g_status_head[ STATUS_COUNT ];
+response_tpl g_header_tail[ TYPE_COUNT ][ 2 ];
+response_tpl g_error_response[ STATUS_COUNT ][ 2 ];
+response_tpl g_not_modified;
+response_tpl g_connection_tail[ 2 ];
+response_tpl g_multipart_end;
+
+//multipart/byteranges的分隔符，启动时随机生成，被发送的文件内容里恰好出现它的可能可以忽略
+static char s_boundary[ 25 ];
+
+int g_max_age = 3600;
+
+//HTTP日期(IMF-fixdate)的格式，都是GMT
+static const char * HTTP_DATE = "%a, %d %b %Y %H:%M:%S GMT";
+
+//所有模板存放在一块静态内存里，只在启动时写一次
+static char s_storage[ 8192 ];
+static int s_used = 0;
+
+static response_tpl build(const char * format, ...){
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(s_storage + s_used, sizeof(s_storage) - s_used, format, args);
+    va_end(args);
+    if(len < 0 || len >= (int)sizeof(s_storage) - s_used){
+        //模板放不下，需要加大s_storage
+        abort();
+    }
+    response_tpl tpl = { s_storage + s_used, len };
+    s_used += len + 1;
+    return tpl;
+}
+
+//启动时生成所有模板
+static bool build_templates(){
+    uint64_t seed = (uint64_t)time(NULL) * 6364136223846793005ULL ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)&seed;
+    for(int i = 0; i < 24; ++i){
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        s_boundary[i] = "0123456789abcdef"[ (seed >> 59) & 15 ];
+    }
+    s_boundary[24] = '\0';
+    char multipart[ 64 ];
+    snprintf(multipart, sizeof(multipart), "multipart/byteranges; boundary=%s", s_boundary);
+    s_types[TYPE_MULTIPART] = build("%s", multipart).data;
+    g_multipart_end = build("\r\n--%s--\r\n", s_boundary);
+
+    for(int st = 0; st < STATUS_COUNT; ++st){
+        g_status_head[st] = build("HTTP/1.1 %d %s\r\nContent-Length: ", s_status[st].code, s_status[st].title);
+    }
+    for(int type = 0; type < TYPE_COUNT; ++type){
+        for(int keep = 0; keep < 2; ++keep){
+            g_header_tail[type][keep] = build("Content-Type: %s\r\nConnection: %s\r\n\r\n", s_types[type], s_connection[keep]);
+        }
+    }
+    g_not_modified = build("HTTP/1.1 %d %s\r\n", s_status[STATUS_304].code, s_status[STATUS_304].title);
+    for(int keep = 0; keep < 2; ++keep){
+        g_connection_tail[keep] = build("Connection: %s\r\n\r\n", s_connection[keep]);
+    }
+    for(int st = 0; st < STATUS_COUNT; ++st){
+        if(!s_status[st].form){
+            continue;
+        }
+        for(int keep = 0; keep < 2; ++keep){
+            g_error_response[st][keep] = build("HTTP/1.1 %d %s\r\nContent-Length: %d\r\n%sContent-Type: %s\r\nConnection: %s\r\n\r\n%s",
+                s_status[st].code, s_status[st].title, (int)strlen(s_status[st].form), s_status[st].extra,
+                s_types[TYPE_HTML], s_connection[keep], s_status[st].form);
+        }
+    }
+    return true;
+}
+
+static bool s_built = build_templates();
+
+int status_code(HTTP_STATUS status){
+    return s_status[status].code;
+}
+
+int format_etag(char * buf, const struct stat & st){
+    unsigned long long mtime = (unsigned long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return snprintf(buf, ETAG_LEN, "\"%llx-%llx-%llx\"",
+                    (unsigned long long)st.st_ino, (unsigned long long)st.st_size, mtime);
+}
+
+int format_variant_etag(char * buf, const char * etag, int etag_len, ENCODING enc){
+    //去掉结尾的引号，加上后缀再补回来
+    return snprintf(buf, ETAG_LEN, "%.*s%s\"", etag_len - 1, etag, s_etag_suffix[enc]);
+}
+
+int format_validators(char * buf, const char * etag, int etag_len, time_t mtime, ENCODING enc, bool vary){
+    char date[ 32 ];
+    struct tm tm;
+    gmtime_r(&mtime, &tm);
+    strftime(date, sizeof(date), HTTP_DATE, &tm);
+    int len;
+    if(g_max_age > 0){
+        len = snprintf(buf, VALIDATORS_LEN, "ETag: %.*s\r\nLast-Modified: %s\r\nCache-Control: public, max-age=%d\r\n",
+                       etag_len, etag, date, g_max_age);
+    }
+    else {
+        len = snprintf(buf, VALIDATORS_LEN, "ETag: %.*s\r\nLast-Modified: %s\r\nCache-Control: no-cache\r\n",
+                       etag_len, etag, date);
+    }
+    if(enc != ENC_IDENTITY){
+        len += snprintf(buf + len, VALIDATORS_LEN - len, "Content-Encoding: %s\r\n", s_encoding_names[enc]);
+    }
+    if(vary){
+        len += snprintf(buf + len, VALIDATORS_LEN - len, "Vary: Accept-Encoding\r\n");
+    }
+    len += snprintf(buf + len, VALIDATORS_LEN - len, "Accept-Ranges: bytes\r\n");
+    return len;
+}
+
+CONTENT_TYPE content_type_of(const char * path){
+    const char * dot = strrchr(path, '.');
+    if(!dot || strchr(dot, '/')){
+        return TYPE_OCTET;
+    }
+    ++dot;
+    for(size_t i = 0; i < sizeof(s_extensions) / sizeof(s_extensions[0]); ++i){
+        if(strcasecmp(dot, s_extensions[i].ext) == 0){
+            return s_extensions[i].type;
+        }
+    }
+    return TYPE_OCTET;
+}
+
+bool compressible(CONTENT_TYPE type){
+    return type <= TYPE_SVG;
+}
+
+//值是逗号分隔的"编码[;q=权重]"，只关心认识的编码有没有被q=0排除
+unsigned accept_encoding(const char * value){
+    unsigned mask = 0;
+    const char * p = value;
+    while(*p){
+        while(*p == ' ' || *p == '\t' || *p == ','){
+            ++p;
+        }
+        const char * name = p;
+        while(*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t'){
+            ++p;
+        }
+        size_t len = p - name;
+
+        //q=0、q=0.0、q=0.000都表示不接受
+        bool refused = false;
+        const char * end = strchr(p, ',');
+        if(!end){
+            end = p + strlen(p);
+        }
+        const char * q = p;
+        while(q < end && *q != 'q' && *q != 'Q'){
+            ++q;
+        }
+        if(q < end && q[1] == '='){
+            q += 2;
+            refused = (*q == '0');
+            for(++q; refused && q < end && *q != ' ' && *q != '\t'; ++q){
+                refused = (*q == '0' || *q == '.');
+            }
+        }
+        p = end;
+        if(len == 0 || refused){
+            continue;
+        }
+
+        if(len == 1 && name[0] == '*'){
+            mask |= (1 << ENC_GZIP) | (1 << ENC_BR);
+        }
+        else if((len == 4 && strncasecmp(name, "gzip", 4) == 0) || (len == 6 && strncasecmp(name, "x-gzip", 6) == 0)){
+            mask |= 1 << ENC_GZIP;
+        }
+        else if(len == 2 && strncasecmp(name, "br", 2) == 0){
+            mask |= 1 << ENC_BR;
+        }
+    }
+    return mask;
+}
+
+char * gzip_compress(const char * data, size_t len, size_t * out_len){
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    //windowBits加16输出gzip格式，压缩只做一次，用最高级别
+    if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK){
+        return NULL;
+    }
+    size_t bound = deflateBound(&zs, len);
+    char * out = (char *)malloc(bound);
+    if(!out){
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = bound;
+    int ret = deflate(&zs, Z_FINISH);
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    if(ret != Z_STREAM_END){
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+//值是逗号分隔的实体标签列表，标签本身带引号
+bool etag_match(const char * list, const char * etag, int etag_len){
+    const char * p = list;
+    while(*p){
+        while(*p == ' ' || *p == '\t' || *p == ','){
+            ++p;
+        }
+        if(*p == '*'){
+            return true;
+        }
+        if(p[0] == 'W' && p[1] == '/'){
+            p += 2;
+        }
+        if(*p != '"'){
+            return false;   //格式不对，当作不匹配
+        }
+        const char * end = strchr(p + 1, '"');
+        if(!end){
+            return false;
+        }
+        ++end;
+        if(end - p == etag_len && memcmp(p, etag, etag_len) == 0){
+            return true;
+        }
+        p = end;
+    }
+    return false;
+}
+
+bool not_modified_since(const char * date, time_t mtime){
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char * end = strptime(date, HTTP_DATE, &tm);
+    if(!end){
+        return false;
+    }
+    return mtime <= timegm(&tm);
+}
+
+//读一个非负十进制数，没有数字或者溢出返回false
+static bool parse_offset(const char *& p, off_t & value){
+    if(*p < '0' || *p > '9'){
+        return false;
+    }
+    value = 0;
+    while(*p >= '0' && *p <= '9'){
+        if(value > (INT64_MAX - 9) / 10){
+            return false;
+        }
+        value = value * 10 + (*p++ - '0');
+    }
+    return true;
+}
+
+int parse_range(const char * value, off_t size, byte_range * ranges){
+    if(strncasecmp(value, "bytes=", 6) != 0){
+        return 0;
+    }
+    const char * p = value + 6;
+    int count = 0;
+    bool any = false;   //至少有一个语法正确的区间
+    while(*p){
+        while(*p == ' ' || *p == '\t' || *p == ','){
+            ++p;
+        }
+        if(!*p){
+            break;
+        }
+        off_t first, last;
+        if(*p == '-'){
+            //后缀区间"-n"：最后n个字节
+            ++p;
+            off_t n;
+            if(!parse_offset(p, n)){
+                return 0;
+            }
+            if(n == 0 || size == 0){
+                any = true;
+                goto next;
+            }
+            first = n < size ? size - n : 0;
+            last = size - 1;
+        }
+        else {
+            if(!parse_offset(p, first) || *p++ != '-'){
+                return 0;
+            }
+            last = size - 1;
+            if(*p >= '0' && *p <= '9'){
+                if(!parse_offset(p, last) || last < first){
+                    return 0;
+                }
+                if(last >= size){
+                    last = size - 1;
+                }
+            }
+            if(first >= size){
+                //起点超出文件的区间不能满足，跳过
+                any = true;
+                goto next;
+            }
+        }
+        any = true;
+        if(count == MAX_RANGES){
+            return 0;
+        }
+        ranges[count].first = first;
+        ranges[count].last = last;
+        ++count;
+    next:
+        while(*p == ' ' || *p == '\t'){
+            ++p;
+        }
+        if(*p && *p != ','){
+            return 0;
+        }
+    }
+    if(count == 0){
+        return any ? -1 : 0;
+    }
+    return count;
+}
+
+bool if_range_match(const char * value, const char * etag, int etag_len, time_t mtime){
+    if(value[0] == '"'){
+        size_t len = strlen(value);
+        while(len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')){
+            --len;
+        }
+        return (int)len == etag_len && memcmp(value, etag, etag_len) == 0;
+    }
+    if(value[0] == 'W' && value[1] == '/'){
+        //弱实体标签不能用于If-Range
+        return false;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if(!strptime(value, HTTP_DATE, &tm)){
+        return false;
+    }
+    return timegm(&tm) == mtime;
+}
+
+int format_part_header(char * buf, CONTENT_TYPE type, off_t first, off_t last, off_t size){
+    return snprintf(buf, PART_HEADER_LEN, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    s_boundary, s_types[type], (long long)first, (long long)last, (long long)size);
+}
@@ -0,0 +1,139 @@
+#ifndef HTTPRESPONSE_H
+#define HTTPRESPONSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+//【响应头模板】状态行和固定的头部字段在启动时按(状态码, Content-Type, 是否保持连接)序列化好，
+//生成响应时只拷贝模板，只有Content-Length需要按请求格式化；
+//错误响应连同错误页面整个预先生成，直接作为发送段发出，不拷贝进写缓冲
+//缓存验证的头部(ETag/Last-Modified/Cache-Control)和内容编码的头部每个文件只生成一次，由文件缓存或静态资源包保存
+
+//响应的状态码
+enum HTTP_STATUS { STATUS_200 = 0, STATUS_206, STATUS_304, STATUS_400, STATUS_403, STATUS_404, STATUS_416, STATUS_500, STATUS_503, STATUS_COUNT };
+
+//响应的Content-Type，文件按扩展名确定
+enum CONTENT_TYPE { TYPE_HTML = 0, TYPE_PLAIN, TYPE_CSS, TYPE_JS, TYPE_JSON, TYPE_XML, TYPE_SVG,
+                    TYPE_JPEG, TYPE_PNG, TYPE_GIF, TYPE_WEBP, TYPE_ICO, TYPE_WOFF2, TYPE_OCTET,
+                    TYPE_MULTIPART,     //多个区间的206响应，multipart/byteranges，带启动时生成的分隔符
+                    TYPE_COUNT };
+
+//内容编码，ENC_IDENTITY为不压缩
+enum ENCODING { ENC_IDENTITY = 0, ENC_GZIP, ENC_BR, ENC_COUNT };
+
+//一段预先序列化好的响应数据
+struct response_tpl {
+    const char * data;
+    int len;
+};
+
+//状态行加上"Content-Length: "，后面紧接着写长度和"\r\n"
+extern response_tpl g_status_head[ STATUS_COUNT ];
+
+//长度之后的固定头部直到空行：Content-Type和Connection，下标[类型][是否保持连接]
+extern response_tpl g_header_tail[ TYPE_COUNT ][ 2 ];
+
+//完整的错误响应(响应头和错误页面)，下标[状态码][是否保持连接]，STATUS_200/206/304/416没有；STATUS_503带Retry-After
+extern response_tpl g_error_response[ STATUS_COUNT ][ 2 ];
+
+//304响应：状态行，接着是文件的验证头部，最后是g_connection_tail[是否保持连接]，没有响应体
+extern response_tpl g_not_modified;
+extern response_tpl g_connection_tail[ 2 ];
+
+//带引号的ETag和三行验证头部的最大长度
+static const int ETAG_LEN = 64;
+static const int VALIDATORS_LEN = 256;
+
+//Cache-Control的max-age秒数，0为"no-cache"(每次使用前都要验证)；启动时设置，之后生成的验证头部才用新值
+extern int g_max_age;
+
+//由inode、大小和修改时间(纳秒)生成强ETag，带引号，返回长度，buf至少ETAG_LEN字节
+int format_etag(char * buf, const struct stat & st);
+
+//压缩过的内容用原文件的ETag加上编码的后缀，如"...-gz"，和未压缩的区分开
+int format_variant_etag(char * buf, const char * etag, int etag_len, ENCODING enc);
+
+//生成"ETag"、"Last-Modified"、"Cache-Control"和"Accept-Ranges"四行头部，返回长度，buf至少VALIDATORS_LEN字节
+//压缩过的内容再加上Content-Encoding；vary为true时(可以压缩的类型，不管这次压没压缩)加上"Vary: Accept-Encoding"
+int format_validators(char * buf, const char * etag, int etag_len, time_t mtime, ENCODING enc = ENC_IDENTITY, bool vary = false);
+
+//按文件名的扩展名确定Content-Type，不认识的为application/octet-stream
+CONTENT_TYPE content_type_of(const char * path);
+
+//文本类的内容，值得压缩
+bool compressible(CONTENT_TYPE type);
+
+//预压缩文件相对原文件的后缀，下标为编码，如ENC_GZIP为".gz"
+extern const char * g_encoding_suffix[ ENC_COUNT ];
+
+//【区间请求】一个响应最多发送的区间数，再多的Range整个忽略，按200发送整个文件
+static const int MAX_RANGES = 8;
+
+//闭区间[first, last]
+struct byte_range {
+    off_t first;
+    off_t last;
+};
+
+//解析Range的值(如"bytes=0-99,200-,-50")，按文件大小size截断后放进ranges
+//返回区间数；0表示语法不对或区间太多，应当忽略Range；-1表示没有一个区间能满足，应当回416
+int parse_range(const char * value, off_t size, byte_range * ranges);
+
+//If-Range的值和文件的当前版本一致，Range才生效：实体标签要强比较相同，日期要和Last-Modified相同
+bool if_range_match(const char * value, const char * etag, int etag_len, time_t mtime);
+
+//multipart/byteranges中一个部分的头部：分隔符、Content-Type和Content-Range，返回长度
+//buf至少PART_HEADER_LEN字节；最后一个部分之后是g_multipart_end
+static const int PART_HEADER_LEN = 192;
+int format_part_header(char * buf, CONTENT_TYPE type, off_t first, off_t last, off_t size);
+extern response_tpl g_multipart_end;
+
+//Accept-Encoding中可以接受的编码，按位表示(1 << ENC_GZIP)；q=0的不算，"*"表示都可以
+unsigned accept_encoding(const char * value);
+
+//把data压缩成gzip格式，返回malloc分配的结果，由调用者free；失败返回NULL
+char * gzip_compress(const char * data, size_t len, size_t * out_len);
+
+//If-None-Match的值中有和etag相同的实体标签，或者是"*"；按弱比较，忽略"W/"前缀
+bool etag_match(const char * list, const char * etag, int etag_len);
+
+//If-Modified-Since的时间不早于mtime，即文件在那之后没有修改过；日期格式不对返回false
+bool not_modified_since(const char * date, time_t mtime);
+
+//状态码的数值，例如STATUS_404返回404
+int status_code(HTTP_STATUS status);
+
+//把无符号整数写成十进制，返回写入的字节数，buf至少要有20字节
+//每次处理两位数，查表得到两个字符，除法次数减半
+inline int format_uint(char * buf, uint64_t v){
+    static const char s_digits[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char tmp[20];
+    char * p = tmp + sizeof(tmp);
+    while(v >= 100){
+        unsigned i = (unsigned)(v % 100) * 2;
+        v /= 100;
+        p -= 2;
+        p[0] = s_digits[i];
+        p[1] = s_digits[i + 1];
+    }
+    if(v >= 10){
+        unsigned i = (unsigned)v * 2;
+        p -= 2;
+        p[0] = s_digits[i];
+        p[1] = s_digits[i + 1];
+    }
+    else {
+        *--p = (char)('0' + v);
+    }
+    int n = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, n);
+    return n;
+}
+
+#endif
@@ -0,0 +1,224 @@
+#include "http_scan.h"
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+//逐字节的实现，也用来处理SIMD实现剩下不足一个向量的尾部
+static const char * find_eol_scalar(const char * p, const char * end){
+    for( ; p < end; ++p){
+        if(*p == '\r' || *p == '\n'){
+            return p;
+        }
+    }
+    return end;
+}
+
+static const char * find_space_scalar(const char * p, const char * end){
+    for( ; p < end; ++p){
+        if(*p == ' ' || *p == '\t'){
+            return p;
+        }
+    }
+    return end;
+}
+
+#ifdef HAVE_X86_SIMD
+//一次比较16个字节，得到的掩码中最低的1就是第一个匹配的位置；只读[p, end)之内的字节
+static const char * find2_sse2(const char * p, const char * end, char a, char b){
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    for( ; p + 16 <= end; p += 16){
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if(mask){
+            return p + __builtin_ctz(mask);
+        }
+    }
+    for( ; p < end; ++p){
+        if(*p == a || *p == b){
+            return p;
+        }
+    }
+    return end;
+}
+
+__attribute__((target("avx2")))
+static const char * find2_avx2(const char * p, const char * end, char a, char b){
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    for( ; p + 32 <= end; p += 32){
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if(mask){
+            return p + __builtin_ctz(mask);
+        }
+    }
+    //尾部也在本函数内处理：跳到非VEX编码的SSE代码前如果没有清掉ymm的高半部分，会付出很大的状态切换代价
+    for( ; p < end; ++p){
+        if(*p == a || *p == b){
+            return p;
+        }
+    }
+    return end;
+}
+
+static const char * find_eol_sse2(const char * p, const char * end){
+    return find2_sse2(p, end, '\r', '\n');
+}
+
+static const char * find_space_sse2(const char * p, const char * end){
+    return find2_sse2(p, end, ' ', '\t');
+}
+
+__attribute__((target("avx2")))
+static const char * find_eol_avx2(const char * p, const char * end){
+    return find2_avx2(p, end, '\r', '\n');
+}
+
+__attribute__((target("avx2")))
+static const char * find_space_avx2(const char * p, const char * end){
+    return find2_avx2(p, end, ' ', '\t');
+}
+#endif
+
+const char * (*find_eol)(const char * p, const char * end) = find_eol_scalar;
+const char * (*find_space)(const char * p, const char * end) = find_space_scalar;
+
+static SCAN_IMPL s_impl = SCAN_SCALAR;
+
+bool scan_select(SCAN_IMPL impl){
+    switch(impl){
+        case SCAN_SCALAR:
+            find_eol = find_eol_scalar;
+            find_space = find_space_scalar;
+            break;
+#ifdef HAVE_X86_SIMD
+        case SCAN_SSE2:
+            if(!__builtin_cpu_supports("sse2")){
+                return false;
+            }
+            find_eol = find_eol_sse2;
+            find_space = find_space_sse2;
+            break;
+        case SCAN_AVX2:
+            if(!__builtin_cpu_supports("avx2")){
+                return false;
+            }
+            find_eol = find_eol_avx2;
+            find_space = find_space_avx2;
+            break;
+#endif
+        default:
+            return false;
+    }
+    s_impl = impl;
+    return true;
+}
+
+SCAN_IMPL scan_current(){
+    return s_impl;
+}
+
+const char * scan_name(SCAN_IMPL impl){
+    static const char * names[] = { "scalar", "sse2", "avx2" };
+    return names[impl];
+}
+
+//请求头名字的完美哈希表
+//哈希的输入是名字的长度、前两个字符和最后一个字符（都转成小写），乘以一个常数后取高位作为槽号；
+//启动时为下面这组名字找一个没有冲突的常数，查找时算一次哈希、比较一次名字即可
+static const struct {
+    const char * name;
+    HTTP_HEADER id;
+} s_headers[] = {
+    { "Connection", HDR_CONNECTION },
+    { "Content-Length", HDR_CONTENT_LENGTH },
+    { "Host", HDR_HOST },
+    { "User-Agent", HDR_USER_AGENT },
+    { "Accept", HDR_ACCEPT },
+    { "Accept-Encoding", HDR_ACCEPT_ENCODING },
+    { "Accept-Language", HDR_ACCEPT_LANGUAGE },
+    { "Cache-Control", HDR_CACHE_CONTROL },
+    { "Cookie", HDR_COOKIE },
+    { "Referer", HDR_REFERER },
+    { "Pragma", HDR_PRAGMA },
+    { "Upgrade-Insecure-Requests", HDR_UPGRADE_INSECURE_REQUESTS },
+    { "If-None-Match", HDR_IF_NONE_MATCH },
+    { "If-Modified-Since", HDR_IF_MODIFIED_SINCE },
+    { "Range", HDR_RANGE },
+    { "If-Range", HDR_IF_RANGE },
+};
+
+static const int HEADER_NUM = sizeof(s_headers) / sizeof(s_headers[0]);
+static const int MAX_TABLE_BITS = 8;
+
+struct header_table {
+    uint32_t mult;      //哈希常数
+    int bits;           //槽数为2^bits
+    uint8_t slots[ 1 << MAX_TABLE_BITS ];   //槽中存s_headers的下标加一，0为空
+
+    header_table();
+};
+
+static inline uint32_t header_key(const char * name, size_t len){
+    uint32_t c0 = (unsigned char)name[0] | 0x20;
+    uint32_t c1 = len > 1 ? ((unsigned char)name[1] | 0x20) : 0;
+    uint32_t cl = (unsigned char)name[len - 1] | 0x20;
+    return ((uint32_t)len << 24) ^ (c0 << 16) ^ (c1 << 8) ^ cl;
+}
+
+static inline uint32_t header_slot(uint32_t key, uint32_t mult, int bits){
+    return (key * mult) >> (32 - bits);
+}
+
+header_table::header_table(){
+    //从最小的表开始，用一个固定的伪随机序列尝试常数，直到所有名字落在不同的槽里
+    uint32_t seed = 0x9e3779b9;
+    for(bits = 5; bits <= MAX_TABLE_BITS; ++bits){
+        for(int attempt = 0; attempt < 100000; ++attempt){
+            seed = seed * 1664525 + 1013904223;
+            mult = seed | 1;
+            memset(slots, 0, sizeof(slots));
+
+            int i = 0;
+            for( ; i < HEADER_NUM; ++i){
+                uint32_t s = header_slot(header_key(s_headers[i].name, strlen(s_headers[i].name)), mult, bits);
+                if(slots[s]){
+                    break;
+                }
+                slots[s] = i + 1;
+            }
+            if(i == HEADER_NUM){
+                return;
+            }
+        }
+    }
+    //名字的特征重复了，需要改header_key
+    abort();
+}
+
+static header_table s_table;
+
+HTTP_HEADER header_id(const char * name, size_t len){
+    if(len == 0){
+        return HDR_UNKNOWN;
+    }
+    int idx = s_table.slots[ header_slot(header_key(name, len), s_table.mult, s_table.bits) ];
+    if(idx == 0){
+        return HDR_UNKNOWN;
+    }
+    const char * candidate = s_headers[idx - 1].name;
+    if(strlen(candidate) != len || strncasecmp(name, candidate, len) != 0){
+        return HDR_UNKNOWN;
+    }
+    return s_headers[idx - 1].id;
+}
+
+//启动时选择CPU支持的最快实现
+static bool s_selected = scan_select(SCAN_AVX2) || scan_select(SCAN_SSE2) || scan_select(SCAN_SCALAR);
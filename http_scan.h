@@ -0,0 +1,48 @@
+#ifndef HTTPSCAN_H
+#define HTTPSCAN_H
+
+#include <stddef.h>
+
+//【HTTP报文扫描】用SIMD一次检查16/32个字节，找行尾和分隔符，并用完美哈希识别请求头的名字
+//启动时按CPU支持的指令集选择AVX2、SSE2或逐字节的实现，三者结果完全相同
+
+//扫描的实现
+enum SCAN_IMPL { SCAN_SCALAR = 0, SCAN_SSE2, SCAN_AVX2 };
+
+//在[p, end)中找第一个'\r'或'\n'，没有返回end
+extern const char * (*find_eol)(const char * p, const char * end);
+
+//在[p, end)中找第一个' '或'\t'，没有返回end
+extern const char * (*find_space)(const char * p, const char * end);
+
+//切换扫描的实现，CPU不支持时返回false；默认已经选好了最快的实现
+bool scan_select(SCAN_IMPL impl);
+SCAN_IMPL scan_current();
+const char * scan_name(SCAN_IMPL impl);
+
+//能识别的请求头
+enum HTTP_HEADER {
+    HDR_UNKNOWN = 0,
+    HDR_CONNECTION,
+    HDR_CONTENT_LENGTH,
+    HDR_HOST,
+    HDR_USER_AGENT,
+    HDR_ACCEPT,
+    HDR_ACCEPT_ENCODING,
+    HDR_ACCEPT_LANGUAGE,
+    HDR_CACHE_CONTROL,
+    HDR_COOKIE,
+    HDR_REFERER,
+    HDR_PRAGMA,
+    HDR_UPGRADE_INSECURE_REQUESTS,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_RANGE,
+    HDR_IF_RANGE,
+    HDR_COUNT
+};
+
+//按名字（不区分大小写，len为名字长度，不含':'）识别请求头，一次哈希加一次比较
+HTTP_HEADER header_id(const char * name, size_t len);
+
+#endif
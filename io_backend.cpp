@@ -0,0 +1,266 @@
+#include "io_backend.h"
+#include "http_conn.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+//添加文件描述符到epoll，连接由accept4直接创建成非阻塞的，不需要再fcntl
+void addFd(int epollFd, int fd, bool one_shot) {
+    epoll_event evt;
+    evt.data.fd = fd;
+    evt.events = EPOLLIN | EPOLLRDHUP;
+
+    if(one_shot){
+        evt.events |= EPOLLONESHOT;
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &evt);
+}
+
+//修改文件描述符，重置socket上的EPOLLONESHOT事件，以确保下一次可读时，EPOLLIN事件能被触发
+void modFd(int epollFd, int fd, int ev) {
+    epoll_event evt;
+    evt.data.fd = fd;
+    evt.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &evt);
+}
+
+long io_backend::m_high_water = 0;
+long (*io_backend::m_queue_depth)() = NULL;
+
+io_backend::io_backend(int id, int listenFd, http_conn * users, bool (*dispatch)(http_conn *)) :
+    m_id(id), m_listenFd(listenFd), m_paused(false), m_users(users), m_dispatch(dispatch), m_timers(new timer_wheel) {}
+
+io_backend::~io_backend(){
+    delete m_timers;
+}
+
+void io_backend::accepted(int connFd, const sockaddr_in & addr){
+    if(http_conn::m_userCnt >= MAX_FD || connFd >= MAX_FD){
+        //目前连接数满了
+        //给客户端写一个信息：服务器内部正忙；写不进去也不等，直接关闭
+        const response_tpl & busy = g_error_response[ STATUS_503 ][ 0 ];
+        send(connFd, busy.data, busy.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(connFd);
+        metrics_add(CNT_CONN_LIMIT);
+        return;
+    }
+
+    //关掉Nagle：一批响应的最后一段不满一个MSS时不用等对方的(延迟)ACK才发出，
+    //sendfile发送时响应头和文件内容分两次系统调用，没有这个每批的尾巴都要多等几十毫秒
+    int nodelay = 1;
+    setsockopt(connFd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    //新的客户端数据初始化，放在数组中，并交给当前循环
+    m_users[connFd].init(connFd, addr, this);
+    metrics_add(CNT_ACCEPTED);
+}
+
+void io_backend::dispatch(http_conn * conn){
+    if(!m_dispatch(conn)){
+        conn->reject();
+    }
+}
+
+bool io_backend::update_admission(){
+    if(m_high_water <= 0 || !m_queue_depth){
+        return false;
+    }
+    long depth = m_queue_depth();
+    bool paused = m_paused;
+    if(depth >= m_high_water){
+        paused = true;
+    }
+    else if(depth < m_high_water / 2){
+        paused = false;
+    }
+    if(paused == m_paused){
+        return false;
+    }
+    m_paused = paused;
+    if(paused){
+        metrics_add(CNT_ACCEPT_PAUSES);
+        LOG_WARN("loop %d 线程池队列长度 %ld 超过高水位，暂停accept", m_id, depth);
+    }
+    return true;
+}
+
+int io_backend::wait_timeout(){
+    int timeout = m_timers->timeout(timer_wheel::now());
+    if(m_paused && (timeout < 0 || timeout > ADMISSION_CHECK_MS)){
+        timeout = ADMISSION_CHECK_MS;
+    }
+    return timeout;
+}
+
+void io_backend::expire_timers(){
+    timer_node * node = m_timers->expire(timer_wheel::now());
+    while(node){
+        timer_node * next = node->next;
+        ((http_conn *)node->data)->expire();
+        node = next;
+    }
+}
+
+epoll_backend::epoll_backend(int id, int listenFd, http_conn * users, bool (*dispatch)(http_conn *)) :
+    io_backend(id, listenFd, users, dispatch), m_notified(false) {
+
+    //创建epoll对象，将监听的文件描述符添加到epoll对象中
+    //用EPOLLEXCLUSIVE注册：多个循环共享同一个监听socket时，来了新连接只唤醒其中一个循环
+    m_epollFd = epoll_create(5);
+    watch_listen(true);
+
+    //工作线程交回连接时用的eventfd，水平触发，事件循环读掉计数后才不再通知
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event evt;
+    evt.data.fd = m_wakeFd;
+    evt.events = EPOLLIN;
+    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeFd, &evt);
+    m_readq = new mpmc_queue<http_conn>(MAX_FD);
+    m_writeq = new mpmc_queue<http_conn>(MAX_FD);
+}
+
+//开始或停止等待新连接；EPOLLEXCLUSIVE不能用EPOLL_CTL_MOD修改，只能删掉再加
+void epoll_backend::watch_listen(bool on){
+    if(!on){
+        epoll_ctl(m_epollFd, EPOLL_CTL_DEL, m_listenFd, NULL);
+        return;
+    }
+    epoll_event evt;
+    evt.data.fd = m_listenFd;
+    evt.events = EPOLLIN | EPOLLEXCLUSIVE;
+    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_listenFd, &evt);
+}
+
+epoll_backend::~epoll_backend(){
+    close(m_wakeFd);
+    close(m_epollFd);
+    delete m_readq;
+    delete m_writeq;
+}
+
+void epoll_backend::add(http_conn * conn){
+    addFd(m_epollFd, conn->fd(), true);
+}
+
+void epoll_backend::rearm(http_conn * conn, int ev){
+    modFd(m_epollFd, conn->fd(), ev);
+}
+
+//放进收件箱，必要时唤醒事件循环；收件箱容量等于连接数上限，不会满
+void epoll_backend::hand_back(http_conn * conn, int ev){
+    mpmc_queue<http_conn> * q = (ev & EPOLLOUT) ? m_writeq : m_readq;
+    while(!q->tryPush(conn)){
+        cpuRelax();
+    }
+    if(!m_notified.exchange(true)){
+        uint64_t one = 1;
+        ssize_t ret = ::write(m_wakeFd, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+//处理工作线程交回的连接：先把m_busy减一，之后定时器才能关闭它，再重新注册
+void epoll_backend::drain(){
+    //先清掉标志再处理收件箱，之后交回的连接一定会再次唤醒
+    uint64_t count;
+    ssize_t ret = ::read(m_wakeFd, &count, sizeof(count));
+    (void)ret;
+    m_notified.store(false);
+
+    http_conn * conn;
+    while(m_readq->tryPop(conn)){
+        conn->returned();
+        modFd(m_epollFd, conn->fd(), EPOLLIN);
+    }
+    while(m_writeq->tryPop(conn)){
+        conn->returned();
+        modFd(m_epollFd, conn->fd(), EPOLLOUT);
+    }
+}
+
+//一次唤醒把等待队列里的连接都接收下来，监听socket是非阻塞的，取空时返回EAGAIN；
+//每次最多ACCEPT_BATCH个，没取完的水平触发会再通知，已有连接的读写不会被饿着
+void epoll_backend::accept_batch(){
+    for(int i = 0; i < ACCEPT_BATCH; ++i){
+        struct sockaddr_in cliAdrr;
+        socklen_t cliLen = sizeof(cliAdrr);
+        int connFd = accept4(m_listenFd, (struct sockaddr *)&cliAdrr, &cliLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(connFd < 0){
+            //共享监听socket时其他循环可能先取走了
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                LOG_WARN("accept errno is: %d", errno);
+            }
+            return;
+        }
+        accepted(connFd, cliAdrr);
+    }
+}
+
+void epoll_backend::remove(http_conn * conn){
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, conn->fd(), 0);
+    conn->release();
+}
+
+void epoll_backend::run(){
+    //事件数组放在堆上，每个循环一份
+    epoll_event * evts = new epoll_event[ MAX_EVENT_NUMBER ];
+
+    while(1){
+        //线程池积压时不再接收新连接，让它们留在内核的accept队列里
+        if(update_admission()){
+            watch_listen(!m_paused);
+        }
+
+        //等到下一个定时器需要处理为止
+        int num = epoll_wait(m_epollFd, evts, MAX_EVENT_NUMBER, wait_timeout());
+
+        if((num < 0) && (errno != EINTR)){
+            LOG_ERROR("epoll failure, errno is: %d", errno);
+            break;
+        }
+
+        for(int i = 0; i < num; ++i){
+
+            int sockFd = evts[i].data.fd;
+            if(sockFd == m_listenFd){
+                //有客户端连接进来
+                accept_batch();
+            }
+            else if(sockFd == m_wakeFd){
+                //工作线程交回了连接
+                drain();
+            }
+             //对方异常断开或错误等事件
+            else if(evts[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                m_users[sockFd].close_conn();
+            }
+
+            //判断是否有读的事件发生
+            else if(evts[i].events & EPOLLIN){
+                if(m_users[sockFd].read()){
+                    //一次性读完所有数据
+                    dispatch(m_users + sockFd);
+                }
+                else { //读取失败/没读到数据，关闭连接
+                    m_users[sockFd].close_conn();
+                }
+            }
+            else if(evts[i].events & EPOLLOUT){
+                if( !m_users[sockFd].write() ){
+                    m_users[sockFd].close_conn();
+                }
+                else if(m_users[sockFd].pipelined()){
+                    //流水线上还有已经读到的请求，直接交给线程池
+                    dispatch(m_users + sockFd);
+                }
+            }
+        }
+
+        expire_timers();
+    }
+    delete [] evts;
+}
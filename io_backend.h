@@ -0,0 +1,108 @@
+#ifndef IOBACKEND_H
+#define IOBACKEND_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <atomic>
+#include "timer_wheel.h"
+#include "work_queue.h"
+
+#define MAX_FD 65535
+#define MAX_EVENT_NUMBER 10000
+
+class http_conn;
+
+//【事件后端】一个事件循环：一个监听socket和一个时间轮，负责本循环上所有连接的accept和读写，解析交给线程池
+//监听socket由main创建和关闭，可以每个循环一个(SO_REUSEPORT)，也可以所有循环共享同一个
+//  - epoll_backend : epoll等待就绪，再由http_conn调用recv/writev/sendfile，每次读写后epoll_ctl重新注册EPOLLONESHOT
+//  - uring_backend : io_uring提交异步的accept/recv/send/splice，完成后直接拿到结果，见uring_backend.h
+//连接通过rearm告诉后端接下来等什么，不关心是哪一种后端
+class io_backend {
+public:
+    //dispatch把读完数据的连接交给线程池，队列满时返回false
+    io_backend(int id, int listenFd, http_conn * users, bool (*dispatch)(http_conn *));
+    virtual ~io_backend();
+
+    //运行事件循环，出错才返回
+    virtual void run() = 0;
+
+    //开始处理新接收的连接，在事件循环线程中调用
+    virtual void add(http_conn * conn) = 0;
+
+    //连接接下来要等待的事件：EPOLLIN读下一个请求，EPOLLOUT发送已经生成的响应；在事件循环线程中调用
+    virtual void rearm(http_conn * conn, int ev) = 0;
+
+    //工作线程(或I/O线程)处理完，把连接交回事件循环，ev同rearm；调用之后就不能再访问连接
+    //连接放进收件箱，由事件循环取出时把m_busy减一再注册ev，交回和减一对事件循环是一步，
+    //期间定时器到期看到的m_busy不为0，不会关掉刚生成好响应的连接
+    virtual void hand_back(http_conn * conn, int ev) = 0;
+
+    //关闭连接，在事件循环线程中调用；还有没完成的I/O时推迟到它们完成后再关闭
+    virtual void remove(http_conn * conn) = 0;
+
+    timer_wheel * timers() { return m_timers; }
+    int id() { return m_id; }
+
+    //过载保护：线程池队列长度达到m_high_water时所有循环暂停accept，降到一半以下再恢复，0为不限制
+    //m_queue_depth读取队列长度，由main设置
+    static long m_high_water;
+    static long (*m_queue_depth)();
+
+protected:
+    //接收了新连接：连接数满了就回503后关掉，否则初始化后交给本循环
+    void accepted(int connFd, const sockaddr_in & addr);
+
+    //把读完数据的连接交给线程池，队列满了由本循环直接回503并关闭连接
+    void dispatch(http_conn * conn);
+
+    //按队列长度更新是否暂停accept，状态改变时返回true，由各后端停止或恢复accept
+    bool update_admission();
+
+    //等待事件的超时：到下一个定时器为止，暂停accept期间至少每ADMISSION_CHECK_MS检查一次队列
+    int wait_timeout();
+
+    //批量关闭到期的连接，只处理到期的那些，不扫描整个users数组
+    void expire_timers();
+
+protected:
+    static const int ADMISSION_CHECK_MS = 10;
+
+    int m_id;
+    int m_listenFd;
+    bool m_paused;                          //是否因过载暂停了accept
+    http_conn * m_users;                    //所有事件循环共享的连接数组，按fd下标索引
+    bool (*m_dispatch)(http_conn *);
+    timer_wheel * m_timers;
+};
+
+//epoll后端，就是原来的事件循环
+class epoll_backend : public io_backend {
+public:
+    epoll_backend(int id, int listenFd, http_conn * users, bool (*dispatch)(http_conn *));
+    ~epoll_backend();
+
+    void run();
+    void add(http_conn * conn);
+    void rearm(http_conn * conn, int ev);
+    void hand_back(http_conn * conn, int ev);
+    void remove(http_conn * conn);
+
+private:
+    //一次唤醒最多接收的连接数
+    static const int ACCEPT_BATCH = 128;
+
+    void accept_batch();
+    void watch_listen(bool on);
+    void drain();   //处理工作线程交回的连接
+
+private:
+    int m_epollFd;
+
+    //工作线程交回的连接：放进收件箱，写eventfd唤醒事件循环；每个连接同一时刻最多在收件箱里一次
+    int m_wakeFd;
+    alignas(CACHE_LINE_SIZE) std::atomic<bool> m_notified;     //已经写过eventfd、事件循环还没处理
+    mpmc_queue<http_conn> * m_readq;    //等待读下一个请求的连接
+    mpmc_queue<http_conn> * m_writeq;   //等待发送响应的连接
+};
+
+#endif
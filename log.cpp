@@ -0,0 +1,233 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+#include "work_queue.h"
+
+//一条日志记录，正好占4个缓存行
+struct log_record {
+    int64_t ms;             //写入时的时间，毫秒
+    uint16_t len;           //text的长度
+    uint8_t level;
+    uint8_t file;
+    char text[ 256 - 12 ];
+};
+
+//每个线程一个单生产者单消费者的环形缓冲区：所属线程写，后台线程读
+//线程退出后缓冲区不回收，服务器的线程都和进程一样长
+struct log_ring {
+    static const size_t SLOTS = 4096;   //必须是2的幂
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;   //下一个写入位置，只有所属线程修改
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;   //下一个读取位置，只有后台线程修改
+    log_ring * next;                                     //所有缓冲区串成只增不减的链表
+    log_record slots[ SLOTS ];
+};
+
+//后台线程每轮之间休眠的时间；有缓冲区超过一半时不休眠
+static const int FLUSH_INTERVAL_MS = 20;
+//每个文件攒够这么多字节写一次
+static const size_t BATCH_BYTES = 64 * 1024;
+
+static std::atomic<log_ring *> s_rings(NULL);
+static thread_local log_ring * t_ring = NULL;
+//缓冲区满而丢弃的日志条数
+static std::atomic<unsigned long> s_dropped(0);
+
+static int s_fds[ LOG_FILE_COUNT ] = { -1, -1 };
+static const char * s_names[ LOG_FILE_COUNT ] = { "server.log", "access.log" };
+static const char * s_levels[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+static pthread_t s_thread;
+static std::atomic<bool> s_running(false);
+
+//线程第一次写日志时创建自己的缓冲区，挂到链表头上
+static log_ring * register_ring(){
+    log_ring * ring = new log_ring;
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    log_ring * first = s_rings.load(std::memory_order_relaxed);
+    do {
+        ring->next = first;
+    } while(!s_rings.compare_exchange_weak(first, ring, std::memory_order_release, std::memory_order_relaxed));
+    return ring;
+}
+
+void log_write(LOG_FILE file, int level, const char * format, ...){
+    log_ring * ring = t_ring;
+    if(!ring){
+        ring = t_ring = register_ring();
+    }
+
+    size_t head = ring->head.load(std::memory_order_relaxed);
+    if(head - ring->tail.load(std::memory_order_acquire) >= log_ring::SLOTS){
+        s_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    log_record & rec = ring->slots[ head & (log_ring::SLOTS - 1) ];
+    //粗粒度时钟走vDSO，不进内核
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    rec.ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    rec.level = level;
+    rec.file = file;
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(rec.text, sizeof(rec.text), format, args);
+    va_end(args);
+    if(len < 0){
+        len = 0;
+    }
+    else if(len >= (int)sizeof(rec.text)){
+        len = sizeof(rec.text) - 1;
+    }
+    rec.len = len;
+
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+//每个日志文件一块批量写的缓冲区
+struct log_batch {
+    char data[ BATCH_BYTES ];
+    size_t used;
+};
+
+static void flush_batch(int file, log_batch & batch){
+    size_t done = 0;
+    while(s_fds[file] >= 0 && done < batch.used){
+        ssize_t n = ::write(s_fds[file], batch.data + done, batch.used - done);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            break;
+        }
+        done += n;
+    }
+    batch.used = 0;
+}
+
+//把一条记录格式化后追加到对应文件的缓冲区，日期时间部分每秒只格式化一次
+static void append_record(log_batch * batches, const log_record & rec){
+    static time_t s_sec = -1;
+    static char s_date[32];
+
+    log_batch & batch = batches[ rec.file ];
+    if(batch.used + sizeof(rec.text) + 64 > BATCH_BYTES){
+        flush_batch(rec.file, batch);
+    }
+
+    time_t sec = rec.ms / 1000;
+    if(sec != s_sec){
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(s_date, sizeof(s_date), "%Y-%m-%d %H:%M:%S", &tm);
+        s_sec = sec;
+    }
+
+    char * out = batch.data + batch.used;
+    size_t left = BATCH_BYTES - batch.used;
+    int n;
+    if(rec.file == LOG_SERVER){
+        n = snprintf(out, left, "%s.%03d %s %.*s\n", s_date, (int)(rec.ms % 1000), s_levels[rec.level], rec.len, rec.text);
+    }
+    else {
+        n = snprintf(out, left, "%s.%03d %.*s\n", s_date, (int)(rec.ms % 1000), rec.len, rec.text);
+    }
+    batch.used += n;
+}
+
+static void * flush_thread(void * arg){
+    log_batch * batches = new log_batch[ LOG_FILE_COUNT ];
+    for(int i = 0; i < LOG_FILE_COUNT; ++i){
+        batches[i].used = 0;
+    }
+
+    while(true){
+        //先读停止标志再收集，log_close之前写入的日志都能在最后一轮写出去
+        bool stopping = !s_running.load(std::memory_order_acquire);
+        bool busy = false;
+
+        //各线程的日志分别按顺序写出，不同线程之间只按轮次大致有序
+        for(log_ring * ring = s_rings.load(std::memory_order_acquire); ring; ring = ring->next){
+            size_t tail = ring->tail.load(std::memory_order_relaxed);
+            size_t head = ring->head.load(std::memory_order_acquire);
+            if(head - tail > log_ring::SLOTS / 2){
+                busy = true;
+            }
+            for( ; tail != head; ++tail){
+                append_record(batches, ring->slots[ tail & (log_ring::SLOTS - 1) ]);
+            }
+            ring->tail.store(tail, std::memory_order_release);
+        }
+
+        unsigned long dropped = s_dropped.exchange(0, std::memory_order_relaxed);
+        if(dropped){
+            log_record rec;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+            rec.ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+            rec.level = LOG_LEVEL_WARN;
+            rec.file = LOG_SERVER;
+            rec.len = snprintf(rec.text, sizeof(rec.text), "日志缓冲区满，丢弃了 %lu 条日志", dropped);
+            append_record(batches, rec);
+        }
+
+        for(int i = 0; i < LOG_FILE_COUNT; ++i){
+            if(batches[i].used){
+                flush_batch(i, batches[i]);
+            }
+        }
+
+        if(stopping){
+            break;
+        }
+        if(!busy){
+            usleep(FLUSH_INTERVAL_MS * 1000);
+        }
+    }
+
+    delete [] batches;
+    return arg;
+}
+
+bool log_init(const char * dir){
+    char path[ 4096 ];
+    for(int i = 0; i < LOG_FILE_COUNT; ++i){
+        snprintf(path, sizeof(path), "%s/%s", dir, s_names[i]);
+        s_fds[i] = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if(s_fds[i] < 0){
+            log_close();
+            return false;
+        }
+    }
+
+    s_running.store(true, std::memory_order_release);
+    if(pthread_create(&s_thread, NULL, flush_thread, NULL) != 0){
+        s_running.store(false);
+        log_close();
+        return false;
+    }
+    return true;
+}
+
+void log_close(){
+    if(s_running.exchange(false)){
+        pthread_join(s_thread, NULL);
+    }
+    for(int i = 0; i < LOG_FILE_COUNT; ++i){
+        if(s_fds[i] >= 0){
+            close(s_fds[i]);
+            s_fds[i] = -1;
+        }
+    }
+}
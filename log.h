@@ -0,0 +1,53 @@
+#ifndef LOG_H
+#define LOG_H
+
+//【异步日志】热路径上只把格式化好的一行写进本线程的无锁环形缓冲区，不加锁、不做系统调用；
+//后台线程定期把所有线程的缓冲区成批写进日志文件。缓冲区满了直接丢弃并计数，不会阻塞调用者
+//低于LOG_LEVEL的日志在编译时整个去掉，参数也不会求值，例如 -DLOG_LEVEL=0 打开调试日志
+//服务器日志写到 server.log，访问日志每个响应一行写到 access.log
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+//日志写到哪个文件
+enum LOG_FILE { LOG_SERVER = 0, LOG_ACCESS_LOG, LOG_FILE_COUNT };
+
+//在目录dir下打开日志文件并启动后台线程，失败返回false；调用之前写的日志先缓存在环形缓冲区里
+bool log_init(const char * dir);
+
+//把缓冲区中剩下的日志写完并停止后台线程
+void log_close();
+
+//写一行日志，不需要带换行符；过长的内容会被截断
+void log_write(LOG_FILE file, int level, const char * format, ...) __attribute__((format(printf, 3, 4)));
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) log_write(LOG_SERVER, LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while(0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) log_write(LOG_SERVER, LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while(0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) log_write(LOG_SERVER, LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while(0)
+#endif
+
+#define LOG_ERROR(...) log_write(LOG_SERVER, LOG_LEVEL_ERROR, __VA_ARGS__)
+
+//访问日志不受级别控制
+#define LOG_ACCESS(...) log_write(LOG_ACCESS_LOG, LOG_LEVEL_INFO, __VA_ARGS__)
+
+#endif
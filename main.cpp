@@ -1,5 +1,6 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -7,23 +8,71 @@
 #include <string.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <sys/epoll.h>
 #include "locker.h"
 #include "thread_pool.h"
+#include "ws_queue.h"
+#include "prio_queue.h"
 #include "http_conn.h"
+#include "file_cache.h"
+#include "static_bundle.h"
+#include "timer_wheel.h"
+#include "io_backend.h"
+#include "uring_backend.h"
+#include "log.h"
+#include "metrics.h"
 
-#define MAX_FD 65535
-#define MAX_EVENT_NUMBER 10000
+//网站的根目录
+extern const char* doc_root;
 
-//添加文件描述符到epoll
-extern void addFd(int epollFd, int fd, bool one_shot);
-//从epoll中删除文件描述符
-extern void rmFd(int epollFd, int fd);
-//修改文件描述符
-extern void modFd(int epollFd, int fd, int ev);
+//线程池的队列策略，编译时加 -DWORK_STEALING 使用工作窃取队列，加 -DPRIORITY_QUEUE 使用按工作量分通道的优先级队列，
+//默认是共享的无锁环形队列
+#if defined(WORK_STEALING)
+typedef threadPool< http_conn, ws_queue<http_conn> > http_pool;
+#elif defined(PRIORITY_QUEUE)
+typedef threadPool< http_conn, prio_queue<http_conn> > http_pool;
+#else
+typedef threadPool< http_conn > http_pool;
+#endif
+
+//线程池队列的容量
+static const int QUEUE_CAPACITY = 10000;
+
+//所有事件循环共享的连接数组和线程池，fd在整个进程内唯一，因此仍按fd下标索引
+static http_conn * users = NULL;
+static http_pool * pool = NULL;
+
+//I/O线程池：把不在内存里的文件内容读进来，事件循环和工作线程都不等磁盘
+//每个连接同一时刻最多有一个预读任务，队列容量按连接数上限
+typedef threadPool< http_conn::prefetch_task > io_pool;
+static io_pool * ioPool = NULL;
+
+static bool prefetch(http_conn::prefetch_task * task){
+    return ioPool->append(task);
+}
+
+//把读完数据的连接交给线程池
+static bool dispatch(http_conn * conn){
+    if(!pool->append(conn)){
+        metrics_add(CNT_DISPATCH_FAILED);
+        return false;
+    }
+    return true;
+}
+
+//运行统计报告中的瞬时值
+static long connectionCount(){
+    return http_conn::m_userCnt;
+}
+
+static long queueDepth(){
+    return pool->size();
+}
 
 //添加信号捕捉
-void addSig(int sig, void( handler )(int)){ 
+void addSig(int sig, void( handler )(int)){
     struct sigaction sa;
     memset(&sa, '\0', sizeof(sa));
     sa.sa_handler = handler;
@@ -31,115 +80,283 @@ void addSig(int sig, void( handler )(int)){
     assert( sigaction(sig, &sa, NULL) != -1 );
 }
 
-int main(int argc, char *argv[]){
-
-    if(argc <= 1){
-        printf("按照下列方式运行程序: %s port number\n", basename(argv[0]));
-        exit(-1);
-    }
-
-    //获取端口号
-    int port = atoi(argv[1]);
-
-    //对sigpie信号进行处理
-    addSig(SIGPIPE, SIG_IGN);
+//打印用法并退出
+void usage(const char * prog){
+    printf("按照下列方式运行程序: %s port number [-l 事件循环数量] [-c 文件缓存大小(MB)] [-s mmap|sendfile] [-t 工作线程数量] [-e epoll|uring] [-L 日志目录] [-b backlog] [-d 延迟accept秒数] [-x] [-w 暂停accept的队列长度] [-q 排队期限(ms)] [-p] [-B 资源包文件] [-m max-age秒数] [-S 大文件门限(MB)] [-i I/O线程数量]\n", basename(prog));
+    exit(-1);
+}
 
-    //创建&初始化线程池
-    threadPool<http_conn> * pool = NULL;
-    try{
-        pool = new threadPool<http_conn>;
-    }
-    catch(...) {
-        exit(-1);
+//创建监听socket，多个事件循环通过SO_REUSEPORT绑定同一端口，由内核在它们之间分发新连接
+//监听socket是非阻塞的，事件循环一次唤醒可以一直accept到队列取空
+//deferSecs大于0时设置TCP_DEFER_ACCEPT，连接收到第一个数据包才进入accept队列
+int createListenFd(int port, int backlog, int deferSecs){
+    int listenFd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listenFd < 0){
+        return -1;
     }
 
-    //创建一个数组来保存所有客户端信息
-    http_conn * users = new http_conn[ MAX_FD ];
-
-    //创建监听socket
-    int listenFd = socket(PF_INET, SOCK_STREAM, 0);
-
     //设置端口复用
     int reuse = 1;
     setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
 
     //绑定
     struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_family = AF_INET;
     address.sin_port = htons(port);
-    bind(listenFd, (sockaddr *)&address, sizeof(address));
+    if(bind(listenFd, (sockaddr *)&address, sizeof(address)) < 0){
+        close(listenFd);
+        return -1;
+    }
 
-    //监听
-    listen(listenFd, 5);
+    if(deferSecs > 0){
+        setsockopt(listenFd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferSecs, sizeof(deferSecs));
+    }
 
-    //创建epoll对象，事件数组，添加监听描述符
-    epoll_event evts[ MAX_EVENT_NUMBER ];
-    int epollFd = epoll_create(5);
+    //监听，backlog超过net.core.somaxconn时由内核截断
+    if(listen(listenFd, backlog) < 0){
+        close(listenFd);
+        return -1;
+    }
+    return listenFd;
+}
 
-    //将监听的文件描述符添加到epoll对象中
-    addFd(epollFd, listenFd, false);
-    http_conn::m_epollFd = epollFd;
+//事件循环线程
+void * runLoop(void * arg){
+    ((io_backend *)arg)->run();
+    return arg;
+}
 
-    while(1){
-        int num = epoll_wait(epollFd, evts, MAX_EVENT_NUMBER, -1);
-        
-        if((num < 0) && (errno != EINTR)){
-            printf("epoll failure\n");
-            break;
+//创建一个事件循环，内核不支持io_uring时退回epoll
+io_backend * createLoop(int id, int listenFd, bool & uring){
+    if(uring){
+        try{
+            return new uring_backend(id, listenFd, users, dispatch);
         }
+        catch(...) {
+            LOG_WARN("内核不支持需要的io_uring特性，改用epoll");
+            uring = false;
+        }
+    }
+    return new epoll_backend(id, listenFd, users, dispatch);
+}
+
+int main(int argc, char *argv[]){
+
+    if(argc <= 1){
+        usage(argv[0]);
+    }
 
-        for(int i = 0; i < num; ++i){
-
-            int sockFd = evts[i].data.fd;
-            if(sockFd == listenFd){
-                //有客户端连接进来
-                struct sockaddr_in cliAdrr;
-                socklen_t cliLen = sizeof(cliAdrr);
-                int connFd = accept(listenFd, (struct sockaddr *)&cliAdrr, &cliLen);
-                if(connFd < 0){
-                    printf("errno is: %d\n", errno);
-                    continue;
+    //事件循环数量，默认每个CPU核一个
+    int loopNum = sysconf(_SC_NPROCESSORS_ONLN);
+    //文件缓存容量，单位MB
+    int cacheMB = 64;
+    //工作线程数量
+    int threadNum = 8;
+    //事件后端
+    bool uring = false;
+    //server.log和access.log所在的目录
+    const char * logDir = ".";
+    //监听队列长度
+    int backlog = SOMAXCONN;
+    //TCP_DEFER_ACCEPT的秒数，0为不设置
+    int deferSecs = 0;
+    //所有事件循环共享一个监听socket，否则每个循环一个
+    bool shared = false;
+    //线程池队列达到这个长度时暂停accept，默认是容量的3/4，0为不限制
+    long highWater = QUEUE_CAPACITY * 3 / 4;
+    //请求排队超过这么多毫秒就不再处理，直接回503，0为不限制
+    int queueDeadline = 1000;
+    //启动时把网站根目录打成静态资源包
+    bool packRoot = false;
+    //事先打好的静态资源包文件，NULL为不使用
+    const char * bundleFile = NULL;
+    //不小于这么多MB的文件不映射，按窗口流式发送，0为不区分
+    int streamMB = 64;
+    //预读文件内容的I/O线程数量，0为不预读
+    int ioThreads = 2;
+    int opt;
+    while((opt = getopt(argc, argv, "l:c:s:t:e:L:b:d:xw:q:pB:m:S:i:")) != -1){
+        switch(opt){
+            case 'l':
+                loopNum = atoi(optarg);
+                break;
+            case 'c':
+                cacheMB = atoi(optarg);
+                break;
+            case 's':
+                //文件内容的发送方式
+                if(strcmp(optarg, "sendfile") == 0){
+                    http_conn::m_transmit = http_conn::TRANSMIT_SENDFILE;
                 }
-                
-                if(http_conn::m_userCnt >= MAX_FD){
-                    //目前连接数满了
-                    //给客户端写一个信息：服务器内部正忙
-                    close(connFd);
-                    continue;
+                else if(strcmp(optarg, "mmap") == 0){
+                    http_conn::m_transmit = http_conn::TRANSMIT_WRITEV;
                 }
-
-                //新的客户端数据初始化，放在数组中
-                users[connFd].init(connFd, cliAdrr);
-            }
-             //对方异常断开或错误等事件
-            else if(evts[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                users[sockFd].close_conn();
-            }
-
-            //判断是否有读的事件发生
-            else if(evts[i].events & EPOLLIN){
-                if(users[sockFd].read()){
-                    //一次性读完所有数据
-                    pool->append(users + sockFd);
+                else {
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                threadNum = atoi(optarg);
+                break;
+            case 'e':
+                if(strcmp(optarg, "uring") == 0){
+                    uring = true;
                 }
-                else { //读取失败/没读到数据，关闭连接
-                    users[sockFd].close_conn();
+                else if(strcmp(optarg, "epoll") == 0){
+                    uring = false;
                 }
-            }
-            else if(evts[i].events & EPOLLOUT){
-                if( !users[sockFd].write() ){
-                    users[sockFd].close_conn();
+                else {
+                    usage(argv[0]);
                 }
-            }
+                break;
+            case 'L':
+                logDir = optarg;
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'd':
+                deferSecs = atoi(optarg);
+                break;
+            case 'x':
+                shared = true;
+                break;
+            case 'w':
+                highWater = atol(optarg);
+                break;
+            case 'q':
+                queueDeadline = atoi(optarg);
+                break;
+            case 'p':
+                packRoot = true;
+                break;
+            case 'B':
+                bundleFile = optarg;
+                break;
+            case 'm':
+                //Cache-Control的max-age，在文件缓存和静态资源包生成验证头部之前设置
+                g_max_age = atoi(optarg);
+                break;
+            case 'S':
+                streamMB = atoi(optarg);
+                break;
+            case 'i':
+                ioThreads = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(loopNum <= 0){
+        loopNum = 1;
+    }
+    if(backlog <= 0 || highWater < 0 || queueDeadline < 0 || g_max_age < 0 || streamMB < 0 || ioThreads < 0){
+        usage(argv[0]);
+    }
+    if(optind >= argc){
+        usage(argv[0]);
+    }
+
+    //获取端口号
+    int port = atoi(argv[optind]);
+
+    //启动日志的后台线程
+    if(!log_init(logDir)){
+        printf("打开日志文件失败, errno is: %d\n", errno);
+        exit(-1);
+    }
+
+    //对sigpie信号进行处理
+    addSig(SIGPIPE, SIG_IGN);
+
+    //初始化文件缓存，并监视网站根目录的变化；sendfile方式不需要映射文件
+    bool mapFiles = (http_conn::m_transmit == http_conn::TRANSMIT_WRITEV);
+    if(!file_cache::instance()->init(doc_root, (size_t)cacheMB << 20, mapFiles, (off_t)streamMB << 20)){
+        printf("初始化文件缓存失败, errno is: %d\n", errno);
+        exit(-1);
+    }
+
+    //静态资源包：包里的文件直接从映像发送，不在包里的仍然走文件缓存
+    //包是启动时的快照，网站根目录之后的修改要重启才能生效
+    if(bundleFile || packRoot){
+        static_bundle * bundle = static_bundle::instance();
+        //大文件不放进常驻内存的映像，和文件缓存用同一个门限，由文件缓存按窗口流式发送
+        off_t streamMin = (off_t)streamMB << 20;
+        bool ok = bundleFile ? bundle->load(bundleFile, streamMin) : bundle->build(doc_root, streamMin);
+        if(!ok){
+            printf("加载静态资源包失败, errno is: %d\n", errno);
+            exit(-1);
         }
+        LOG_INFO("静态资源包已加载");
     }
-    close(epollFd);
-    close(listenFd);
 
+    //创建&初始化线程池
+#if !defined(WORK_STEALING) && defined(PRIORITY_QUEUE)
+    prio_queue<http_conn>::m_classify = http_conn::classify;
+#endif
+    try{
+        pool = new http_pool(threadNum, QUEUE_CAPACITY);
+        if(ioThreads > 0){
+            ioPool = new io_pool(ioThreads, MAX_FD);
+            http_conn::m_prefetch = prefetch;
+        }
+    }
+    catch(...) {
+        exit(-1);
+    }
+
+    metrics_gauge(GAUGE_CONNECTIONS, connectionCount);
+    metrics_gauge(GAUGE_QUEUE_DEPTH, queueDepth);
+
+    //过载保护
+    io_backend::m_high_water = highWater;
+    io_backend::m_queue_depth = queueDepth;
+    http_conn::m_queue_deadline = queueDeadline;
+
+    //创建一个数组来保存所有客户端信息
+    users = new http_conn[ MAX_FD ];
+
+    //每个事件循环一个监听socket；共享模式下只创建一个，各循环用EPOLLEXCLUSIVE等待它，一次只唤醒一个循环
+    int listenNum = shared ? 1 : loopNum;
+    int * listenFds = new int[ listenNum ];
+    for(int i = 0; i < listenNum; ++i){
+        listenFds[i] = createListenFd(port, backlog, deferSecs);
+        if(listenFds[i] < 0){
+            printf("创建监听socket失败, errno is: %d\n", errno);
+            exit(-1);
+        }
+    }
+    io_backend ** loops = new io_backend *[ loopNum ];
+    for(int i = 0; i < loopNum; ++i){
+        loops[i] = createLoop(i, listenFds[shared ? 0 : i], uring);
+    }
+
+    //前loopNum-1个循环各开一个线程，最后一个循环在主线程中运行
+    pthread_t tid;
+    for(int i = 0; i < loopNum - 1; ++i){
+        LOG_INFO("创建第 %d 个事件循环", i);
+        if(pthread_create(&tid, NULL, runLoop, loops[i]) != 0){
+            exit(-1);
+        }
+    }
+    runLoop(loops[loopNum - 1]);
+
+    for(int i = 0; i < loopNum; ++i){
+        delete loops[i];
+    }
+
+    delete [] loops;
+    for(int i = 0; i < listenNum; ++i){
+        close(listenFds[i]);
+    }
+    delete [] listenFds;
     delete [] users;
     delete pool;
+    delete ioPool;
+    log_close();
 
     return 0;
 }
-
@@ -0,0 +1,183 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include "work_queue.h"
+
+//HDR式的对数-线性分桶：小于16的值一个值一桶，之后每个2的幂区间再均分成16个桶，
+//相对误差不超过1/16；超过2^41纳秒（约36分钟）的都算进最后一个桶
+static const int SUB_BITS = 4;
+static const int SUB_BUCKETS = 1 << SUB_BITS;
+static const int MAX_EXP = 40;
+static const int HIST_BUCKETS = (MAX_EXP - SUB_BITS + 2) * SUB_BUCKETS;
+
+static inline int bucket_of(uint64_t v){
+    if(v < (uint64_t)SUB_BUCKETS){
+        return (int)v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    if(e > MAX_EXP){
+        return HIST_BUCKETS - 1;
+    }
+    int sub = (v >> (e - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return (e - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+//桶中最小的值
+static inline uint64_t bucket_low(int idx){
+    if(idx < SUB_BUCKETS){
+        return idx;
+    }
+    int e = idx / SUB_BUCKETS + SUB_BITS - 1;
+    return (uint64_t)(SUB_BUCKETS + idx % SUB_BUCKETS) << (e - SUB_BITS);
+}
+
+//每个线程的统计槽，只有所属线程写，其他线程只在生成报告时读
+//计数用relaxed的load+store累加，不需要带lock前缀的指令；整个槽按缓存行对齐，线程之间不会伪共享
+struct alignas(CACHE_LINE_SIZE) metrics_slot {
+    std::atomic<uint64_t> counters[ CNT_COUNT ];
+    std::atomic<uint64_t> responses[ STATUS_COUNT ];
+    std::atomic<uint64_t> sum[ STAGE_COUNT ];
+    std::atomic<uint64_t> max[ STAGE_COUNT ];
+    std::atomic<uint64_t> hist[ STAGE_COUNT ][ HIST_BUCKETS ];
+    metrics_slot * next;    //所有槽串成只增不减的链表
+};
+
+static std::atomic<metrics_slot *> s_slots(NULL);
+static thread_local metrics_slot * t_slot = NULL;
+static long (*s_gauges[ GAUGE_COUNT ])() = { NULL };
+static uint64_t s_start = metrics_now();
+
+static const char * s_stage_names[ STAGE_COUNT ] = { "queue_wait", "parse", "open", "send" };
+static const char * s_counter_names[ CNT_COUNT ] = { "accepted", "bytes_sent", "send_eagain", "timeouts", "dispatch_failed", "shed_stale", "conn_limit", "accept_pauses", "prefetches" };
+static const char * s_gauge_names[ GAUGE_COUNT ] = { "connections", "queue_depth" };
+
+uint64_t metrics_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//线程第一次记录时创建自己的槽
+static metrics_slot * local_slot(){
+    metrics_slot * slot = t_slot;
+    if(slot){
+        return slot;
+    }
+    //值初始化把所有计数清零
+    slot = new metrics_slot();
+    metrics_slot * first = s_slots.load(std::memory_order_relaxed);
+    do {
+        slot->next = first;
+    } while(!s_slots.compare_exchange_weak(first, slot, std::memory_order_release, std::memory_order_relaxed));
+    t_slot = slot;
+    return slot;
+}
+
+static inline void bump(std::atomic<uint64_t> & value, uint64_t n){
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void metrics_record(METRIC_STAGE stage, uint64_t ns){
+    metrics_slot * slot = local_slot();
+    bump(slot->hist[stage][ bucket_of(ns) ], 1);
+    bump(slot->sum[stage], ns);
+    if(ns > slot->max[stage].load(std::memory_order_relaxed)){
+        slot->max[stage].store(ns, std::memory_order_relaxed);
+    }
+}
+
+void metrics_add(METRIC_COUNTER counter, uint64_t n){
+    bump(local_slot()->counters[counter], n);
+}
+
+void metrics_response(HTTP_STATUS status){
+    bump(local_slot()->responses[status], 1);
+}
+
+void metrics_gauge(METRIC_GAUGE gauge, long (*read)()){
+    s_gauges[gauge] = read;
+}
+
+//直方图中第rank个值（从1开始）所在桶的上界，不超过实际的最大值
+static double percentile_us(const uint64_t * hist, uint64_t count, uint64_t max, double q){
+    uint64_t rank = (uint64_t)(q * count + 0.999999);
+    if(rank == 0){
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for(int i = 0; i < HIST_BUCKETS; ++i){
+        seen += hist[i];
+        if(seen >= rank){
+            uint64_t high = (i + 1 < HIST_BUCKETS) ? bucket_low(i + 1) - 1 : max;
+            return (high < max ? high : max) / 1000.0;
+        }
+    }
+    return max / 1000.0;
+}
+
+int metrics_render(char * buf, int size){
+    uint64_t counters[ CNT_COUNT ] = { 0 };
+    uint64_t responses[ STATUS_COUNT ] = { 0 };
+    uint64_t sum[ STAGE_COUNT ] = { 0 };
+    uint64_t max[ STAGE_COUNT ] = { 0 };
+    static thread_local uint64_t hist[ STAGE_COUNT ][ HIST_BUCKETS ];
+    memset(hist, 0, sizeof(hist));
+
+    for(metrics_slot * slot = s_slots.load(std::memory_order_acquire); slot; slot = slot->next){
+        for(int i = 0; i < CNT_COUNT; ++i){
+            counters[i] += slot->counters[i].load(std::memory_order_relaxed);
+        }
+        for(int i = 0; i < STATUS_COUNT; ++i){
+            responses[i] += slot->responses[i].load(std::memory_order_relaxed);
+        }
+        for(int st = 0; st < STAGE_COUNT; ++st){
+            sum[st] += slot->sum[st].load(std::memory_order_relaxed);
+            uint64_t m = slot->max[st].load(std::memory_order_relaxed);
+            if(m > max[st]){
+                max[st] = m;
+            }
+            for(int i = 0; i < HIST_BUCKETS; ++i){
+                hist[st][i] += slot->hist[st][i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    int len = 0;
+#define EMIT(...) do { if(len < size) len += snprintf(buf + len, size - len, __VA_ARGS__); } while(0)
+    EMIT("uptime_seconds %llu\n", (unsigned long long)((metrics_now() - s_start) / 1000000000));
+    for(int i = 0; i < GAUGE_COUNT; ++i){
+        if(s_gauges[i]){
+            EMIT("%s %ld\n", s_gauge_names[i], s_gauges[i]());
+        }
+    }
+    for(int i = 0; i < CNT_COUNT; ++i){
+        EMIT("%s %llu\n", s_counter_names[i], (unsigned long long)counters[i]);
+    }
+    uint64_t requests = 0;
+    for(int i = 0; i < STATUS_COUNT; ++i){
+        requests += responses[i];
+        EMIT("responses_%d %llu\n", status_code((HTTP_STATUS)i), (unsigned long long)responses[i]);
+    }
+    EMIT("requests %llu\n", (unsigned long long)requests);
+
+    for(int st = 0; st < STAGE_COUNT; ++st){
+        uint64_t count = 0;
+        for(int i = 0; i < HIST_BUCKETS; ++i){
+            count += hist[st][i];
+        }
+        const char * name = s_stage_names[st];
+        EMIT("%s_count %llu\n", name, (unsigned long long)count);
+        if(count == 0){
+            continue;
+        }
+        EMIT("%s_mean_us %.1f\n", name, sum[st] / 1000.0 / count);
+        EMIT("%s_p50_us %.1f\n", name, percentile_us(hist[st], count, max[st], 0.5));
+        EMIT("%s_p99_us %.1f\n", name, percentile_us(hist[st], count, max[st], 0.99));
+        EMIT("%s_p999_us %.1f\n", name, percentile_us(hist[st], count, max[st], 0.999));
+        EMIT("%s_max_us %.1f\n", name, max[st] / 1000.0);
+    }
+#undef EMIT
+    return len < size ? len : size - 1;
+}
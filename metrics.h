@@ -0,0 +1,58 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "http_response.h"
+
+//【运行统计】各阶段的耗时直方图和计数器
+//每个线程写自己的统计槽（独占缓存行，只有本线程写，不需要原子的读-改-写），
+//生成报告时才把所有线程的槽加在一起；报告由保留的URL /__stats 从内存中输出
+
+//耗时的阶段
+enum METRIC_STAGE {
+    STAGE_QUEUE = 0,    //交给线程池到工作线程开始处理
+    STAGE_PARSE,        //解析一个请求
+    STAGE_OPEN,         //从文件缓存取得目标文件
+    STAGE_SEND,         //一批响应生成好到全部发完
+    STAGE_COUNT
+};
+
+//计数器
+enum METRIC_COUNTER {
+    CNT_ACCEPTED = 0,       //接受的连接
+    CNT_BYTES_SENT,         //发送的字节数
+    CNT_SEND_EAGAIN,        //发送时socket写缓冲满了
+    CNT_TIMEOUTS,           //因期限到了而关闭的连接
+    CNT_DISPATCH_FAILED,    //线程池队列满，没能交给线程池，回了503
+    CNT_SHED_STALE,         //在队列里等得太久，没有处理直接回了503
+    CNT_CONN_LIMIT,         //连接数满了，回503后关闭的新连接
+    CNT_ACCEPT_PAUSES,      //队列超过高水位而暂停accept的次数
+    CNT_PREFETCHES,         //文件内容不在内存里，交给I/O线程预读的次数
+    CNT_COUNT
+};
+
+//由其他模块提供的瞬时值，生成报告时调用登记的函数读取
+enum METRIC_GAUGE {
+    GAUGE_CONNECTIONS = 0,  //当前连接数
+    GAUGE_QUEUE_DEPTH,      //线程池队列长度
+    GAUGE_COUNT
+};
+
+//单调时钟，单位纳秒
+uint64_t metrics_now();
+
+//记录某个阶段的一次耗时
+void metrics_record(METRIC_STAGE stage, uint64_t ns);
+
+void metrics_add(METRIC_COUNTER counter, uint64_t n = 1);
+
+//记录一个生成好的响应
+void metrics_response(HTTP_STATUS status);
+
+void metrics_gauge(METRIC_GAUGE gauge, long (*read)());
+
+//把所有线程的统计汇总成文本报告写进buf，返回长度
+int metrics_render(char * buf, int size);
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef PRIOQUEUE_H
+#define PRIOQUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <atomic>
+#include "work_queue.h"
+
+//【优先级队列】threadPool的队列策略之一，接口和work_queue.h中的相同
+//入队时由分类函数把请求分到PRIO_LANES条通道中的一条，通道号越小越先处理，
+//比如预计工作量小的请求走0号通道，不会排在一批大请求后面；
+//为了不让低优先级的请求饿死，每条通道有一个老化期限：通道有请求却超过期限没被处理过，就比更高优先级的通道先处理
+//每条通道是一个无锁环形队列(mpmc_queue)，入队出队不加锁、不分配内存；
+//所有通道共用一个futex，队列为空时工作线程先自旋再睡眠，生产者只在有睡眠者时才唤醒
+template<typename T>
+class prio_queue {
+public:
+    static const int PRIO_LANES = 3;
+
+    //请求分到哪条通道，返回0到PRIO_LANES-1，在入队的线程中调用，不能阻塞；NULL时都进0号通道，退化为FIFO
+    static int (*m_classify)(T* request);
+
+    //各通道的老化期限，单位毫秒；0号通道本来就最先处理，不需要老化
+    static int m_aging_ms[ PRIO_LANES ];
+
+    prio_queue(int capacity, int workers = 1);
+    ~prio_queue();
+
+    bool push(T* request);
+    T* pop(int worker = 0);
+    void stop();
+    size_t size();
+
+private:
+    //队列为空时自旋的次数
+    static const int SPIN_COUNT = 64;
+
+    static uint64_t now();
+
+    //不阻塞地按优先级和老化期限取一个请求
+    bool tryTake(T*& request);
+
+private:
+    //每条通道都能放下全部容量，总数由m_count限制
+    mpmc_queue<T> * m_lanes[ PRIO_LANES ];
+    size_t m_capacity;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_count;
+
+    //各通道最近一次出队或者由空变为非空的时刻，老化期限从这里算起；只是近似值，不需要和入队出队严格同步
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> m_since[ PRIO_LANES ];
+
+    //睡眠相关：m_futex是等待的序号，生产者发现有睡眠者时把它加一并唤醒
+    alignas(CACHE_LINE_SIZE) std::atomic<int> m_futex;
+    std::atomic<int> m_sleepers;
+    std::atomic<bool> m_stop;
+};
+
+template<typename T>
+int (*prio_queue<T>::m_classify)(T* request) = NULL;
+
+template<typename T>
+int prio_queue<T>::m_aging_ms[ PRIO_LANES ] = { 0, 10, 50 };
+
+template<typename T>
+prio_queue<T>::prio_queue(int capacity, int) :
+    m_capacity(capacity), m_count(0), m_futex(0), m_sleepers(0), m_stop(false) {
+    for(int i = 0; i < PRIO_LANES; ++i){
+        m_lanes[i] = new mpmc_queue<T>(capacity);
+        m_since[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+template<typename T>
+prio_queue<T>::~prio_queue(){
+    for(int i = 0; i < PRIO_LANES; ++i){
+        delete m_lanes[i];
+    }
+}
+
+template<typename T>
+uint64_t prio_queue<T>::now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+template<typename T>
+bool prio_queue<T>::push(T* request){
+    int idx = m_classify ? m_classify(request) : 0;
+    if(idx < 0 || idx >= PRIO_LANES){
+        idx = PRIO_LANES - 1;
+    }
+
+    if(m_count.fetch_add(1, std::memory_order_relaxed) >= m_capacity){
+        m_count.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    mpmc_queue<T> * lane = m_lanes[idx];
+    if(idx > 0 && lane->size() == 0){
+        m_since[idx].store(now(), std::memory_order_relaxed);
+    }
+    if(!lane->tryPush(request)){
+        m_count.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    //与pop中登记睡眠者之后的再次检查配对：要么消费者看到新数据，要么这里看到睡眠者
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(m_sleepers.load(std::memory_order_relaxed) > 0){
+        m_futex.fetch_add(1, std::memory_order_release);
+        futexWake(&m_futex, 1);
+    }
+    return true;
+}
+
+template<typename T>
+bool prio_queue<T>::tryTake(T*& request){
+    //先看有没有超过老化期限的通道，优先级低的先看；都没有就按优先级取
+    //只有低优先级的通道里有请求时才读时钟
+    uint64_t t = 0;
+    for(int i = PRIO_LANES - 1; i > 0; --i){
+        if(m_lanes[i]->size() == 0){
+            continue;
+        }
+        if(t == 0){
+            t = now();
+        }
+        if(t - m_since[i].load(std::memory_order_relaxed) > (uint64_t)m_aging_ms[i] * 1000000
+            && m_lanes[i]->tryPop(request)){
+            m_since[i].store(t, std::memory_order_relaxed);
+            m_count.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    for(int i = 0; i < PRIO_LANES; ++i){
+        if(m_lanes[i]->tryPop(request)){
+            if(i > 0){
+                m_since[i].store(t ? t : now(), std::memory_order_relaxed);
+            }
+            m_count.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename T>
+T* prio_queue<T>::pop(int){
+    T* request = NULL;
+    for(int i = 0; i < SPIN_COUNT; ++i){
+        if(tryTake(request)){
+            return request;
+        }
+        cpuRelax();
+    }
+
+    while(!m_stop.load(std::memory_order_relaxed)){
+        int seq = m_futex.load(std::memory_order_acquire);
+        m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+        if(tryTake(request)){
+            m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+            return request;
+        }
+        //序号没变才睡，生产者在这之间入队会改变序号，futex立即返回
+        futexWait(&m_futex, seq);
+        m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+        if(tryTake(request)){
+            return request;
+        }
+    }
+    return NULL;
+}
+
+template<typename T>
+void prio_queue<T>::stop(){
+    m_stop.store(true);
+    m_futex.fetch_add(1);
+    futexWake(&m_futex, INT_MAX);
+}
+
+template<typename T>
+size_t prio_queue<T>::size(){
+    return m_count.load(std::memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef SLABPOOL_H
+#define SLABPOOL_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include "locker.h"
+
+//【slab内存池】分配固定大小的Block，模板参数Block为内存块的类型
+//每个线程有一个本地空闲链表，分配和释放通常不加锁；本地链表空了从全局链表成批取，
+//攒得太多了成批还给全局链表；全局链表也空了就向系统申请一整块slab切成SLAB_BLOCKS个内存块。
+//内存块可以在一个线程分配、在另一个线程释放。分配出去的内存不清零
+template<typename Block>
+class slab_pool {
+public:
+    //分配一个内存块，失败返回NULL
+    static Block * alloc();
+
+    //释放alloc得到的内存块
+    static void free(Block * block);
+
+private:
+    //空闲的内存块头部存放链表指针
+    struct free_node {
+        free_node * next;
+    };
+
+    //线程本地的空闲链表
+    struct local_cache {
+        free_node * head;
+        int count;
+    };
+
+    //每块slab切成多少个内存块
+    static const int SLAB_BLOCKS = 64;
+    //本地空闲链表与全局链表之间一次搬运的数量，本地超过两倍时归还
+    static const int BATCH = 32;
+
+    static const size_t BLOCK_BYTES = sizeof(Block) > sizeof(free_node) ? sizeof(Block) : sizeof(free_node);
+
+    static bool refill(local_cache & cache);
+    static void drain(local_cache & cache);
+
+private:
+    static thread_local local_cache t_cache;
+
+    //全局空闲链表，受s_lock保护
+    static locker s_lock;
+    static free_node * s_free;
+};
+
+template<typename Block>
+thread_local typename slab_pool<Block>::local_cache slab_pool<Block>::t_cache = { NULL, 0 };
+
+template<typename Block>
+locker slab_pool<Block>::s_lock;
+
+template<typename Block>
+typename slab_pool<Block>::free_node * slab_pool<Block>::s_free = NULL;
+
+//从全局链表取一批到本地，全局链表空了就新建一块slab
+template<typename Block>
+bool slab_pool<Block>::refill(local_cache & cache){
+    s_lock.lock();
+    if(!s_free){
+        char * slab = (char *)malloc(BLOCK_BYTES * SLAB_BLOCKS);
+        if(!slab){
+            s_lock.unlock();
+            return false;
+        }
+        for(int i = 0; i < SLAB_BLOCKS; ++i){
+            free_node * node = (free_node *)(slab + i * BLOCK_BYTES);
+            node->next = s_free;
+            s_free = node;
+        }
+    }
+    for(int i = 0; i < BATCH && s_free; ++i){
+        free_node * node = s_free;
+        s_free = node->next;
+        node->next = cache.head;
+        cache.head = node;
+        ++cache.count;
+    }
+    s_lock.unlock();
+    return true;
+}
+
+//把本地链表中的一批还给全局链表
+template<typename Block>
+void slab_pool<Block>::drain(local_cache & cache){
+    s_lock.lock();
+    for(int i = 0; i < BATCH && cache.head; ++i){
+        free_node * node = cache.head;
+        cache.head = node->next;
+        --cache.count;
+        node->next = s_free;
+        s_free = node;
+    }
+    s_lock.unlock();
+}
+
+template<typename Block>
+Block * slab_pool<Block>::alloc(){
+    local_cache & cache = t_cache;
+    if(!cache.head && !refill(cache)){
+        return NULL;
+    }
+    free_node * node = cache.head;
+    cache.head = node->next;
+    --cache.count;
+    return new (node) Block;
+}
+
+template<typename Block>
+void slab_pool<Block>::free(Block * block){
+    if(!block){
+        return;
+    }
+    block->~Block();
+
+    local_cache & cache = t_cache;
+    free_node * node = (free_node *)block;
+    node->next = cache.head;
+    cache.head = node;
+    if(++cache.count > 2 * BATCH){
+        drain(cache);
+    }
+}
+
+#endif
@@ -0,0 +1,474 @@
+#include "static_bundle.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "http_response.h"
+
+static const char BUNDLE_MAGIC[ 8 ] = { 'W', 'S', 'B', 'U', 'N', 'D', 'L', 'E' };
+static const uint32_t BUNDLE_VERSION = 4;
+
+//每个槽位数下尝试这么多个乘数，都有冲突就把槽数翻倍
+static const int MAX_TRIES = 100000;
+
+//后台压缩的文件大小范围，和文件缓存一致
+static const off_t COMPRESS_MIN = 256;
+static const off_t COMPRESS_MAX = 16 << 20;
+
+//打包时的一个条目：一个文件，或者一个文件的压缩版本
+struct pack_file {
+    std::string url;
+    std::string path;       //内容所在的文件
+    struct stat st;
+    CONTENT_TYPE type;
+    ENCODING enc;
+    size_t origin;          //压缩版本所属文件的下标
+    std::string data;       //打包时压缩的内容，这时path不用
+    bool generated;
+};
+
+//URL的哈希(FNV-1a)，再乘以乘数取高bits位作为槽号
+static inline uint64_t url_hash(const char * url, size_t len){
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < len; ++i){
+        h ^= (unsigned char)url[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static inline uint32_t slot_of(uint64_t hash, uint64_t mult, uint32_t bits){
+    return (uint32_t)((hash * mult) >> (64 - bits));
+}
+
+//候选乘数序列(splitmix64)，取奇数
+static inline uint64_t next_mult(uint64_t & state){
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return (z ^ (z >> 31)) | 1;
+}
+
+//递归收集dir下的文件，跳过目录以外的特殊文件和其他人不可读的文件，和do_request的判断一致
+//映像整个常驻内存，不小于streamMin的大文件不打包，留给文件缓存按窗口流式发送；0为不区分
+static bool collect(const std::string & dir, const std::string & url, std::vector<pack_file> & files, off_t streamMin){
+    DIR * d = opendir(dir.c_str());
+    if(!d){
+        return false;
+    }
+    struct dirent * ent;
+    while((ent = readdir(d)) != NULL){
+        if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0){
+            continue;
+        }
+        std::string path = dir + "/" + ent->d_name;
+        struct stat st;
+        if(stat(path.c_str(), &st) < 0){
+            continue;
+        }
+        if(S_ISDIR(st.st_mode)){
+            if(!collect(path, url + ent->d_name + "/", files, streamMin)){
+                closedir(d);
+                return false;
+            }
+        }
+        else if(S_ISREG(st.st_mode) && (st.st_mode & S_IROTH) && (streamMin <= 0 || st.st_size < streamMin)){
+            pack_file f;
+            f.url = url + ent->d_name;
+            f.path = path;
+            f.st = st;
+            f.type = content_type_of(f.url.c_str());
+            f.enc = ENC_IDENTITY;
+            f.generated = false;
+            files.push_back(f);
+        }
+    }
+    closedir(d);
+    return true;
+}
+
+//为所有URL找一个没有冲突的乘数，槽数至少是文件数的两倍
+//只有前count个(原文件)进哈希表，压缩版本通过所属文件的条目找到
+static bool perfect_hash(const std::vector<pack_file> & files, size_t count, uint32_t & bits, uint64_t & mult){
+    bits = 4;
+    while(((size_t)1 << bits) < count * 2){
+        ++bits;
+    }
+    std::vector<uint64_t> hashes;
+    for(size_t i = 0; i < count; ++i){
+        hashes.push_back(url_hash(files[i].url.data(), files[i].url.size()));
+    }
+    uint64_t state = 0;
+    for(; bits <= 24; ++bits){
+        std::vector<char> used((size_t)1 << bits);
+        for(int t = 0; t < MAX_TRIES; ++t){
+            mult = next_mult(state);
+            std::fill(used.begin(), used.end(), 0);
+            size_t i = 0;
+            for(; i < hashes.size(); ++i){
+                char & u = used[ slot_of(hashes[i], mult, bits) ];
+                if(u){
+                    break;
+                }
+                u = 1;
+            }
+            if(i == hashes.size()){
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool write_all(int fd, const char * data, size_t len){
+    while(len > 0){
+        ssize_t n = write(fd, data, len);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+//把文件内容原样拷进映像，长度和打包开始时stat的不一致说明文件正在被修改，放弃这次打包
+static bool copy_body(int out, const pack_file & f){
+    if(f.generated){
+        return write_all(out, f.data.data(), f.data.size());
+    }
+    int in = open(f.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(in < 0){
+        return false;
+    }
+    static const size_t CHUNK = 64 * 1024;
+    std::vector<char> buf(CHUNK);
+    uint64_t left = f.st.st_size;
+    while(left > 0){
+        ssize_t n = read(in, buf.data(), left < CHUNK ? left : CHUNK);
+        if(n <= 0){
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            close(in);
+            return false;
+        }
+        if(!write_all(out, buf.data(), n)){
+            close(in);
+            return false;
+        }
+        left -= n;
+    }
+    close(in);
+    return true;
+}
+
+//200和304响应头，和http_conn::process_write对缓存中的文件生成的完全一样
+static std::string serialize_head(uint64_t size, CONTENT_TYPE type, const std::string & validators, int keep){
+    char len[ 24 ];
+    int n = format_uint(len, size);
+    std::string head(g_status_head[ STATUS_200 ].data, g_status_head[ STATUS_200 ].len);
+    head.append(len, n);
+    head += "\r\n";
+    head += validators;
+    head.append(g_header_tail[ type ][ keep ].data, g_header_tail[ type ][ keep ].len);
+    return head;
+}
+
+static std::string serialize_not_modified(const std::string & validators, int keep){
+    std::string head(g_not_modified.data, g_not_modified.len);
+    head += validators;
+    head.append(g_connection_tail[ keep ].data, g_connection_tail[ keep ].len);
+    return head;
+}
+
+//为可以压缩的文件找旁边事先压缩好的.br/.gz(不比原文件旧)，没有.gz的现压缩一份，省不到10%的不要
+static void add_variants(std::vector<pack_file> & files, size_t count){
+    for(size_t i = 0; i < count; ++i){
+        if(!compressible(files[i].type)){
+            continue;
+        }
+        bool gzip = false;
+        for(int enc = ENC_GZIP; enc < ENC_COUNT; ++enc){
+            pack_file v = files[i];
+            v.path += g_encoding_suffix[enc];
+            if(stat(v.path.c_str(), &v.st) < 0 || !S_ISREG(v.st.st_mode) || !(v.st.st_mode & S_IROTH)
+                || v.st.st_mtime < files[i].st.st_mtime){
+                continue;
+            }
+            v.enc = (ENCODING)enc;
+            v.origin = i;
+            files.push_back(v);
+            gzip = gzip || enc == ENC_GZIP;
+        }
+        const pack_file & f = files[i];
+        if(gzip || f.st.st_size < COMPRESS_MIN || f.st.st_size > COMPRESS_MAX){
+            continue;
+        }
+        int in = open(f.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(in < 0){
+            continue;
+        }
+        std::vector<char> buf(f.st.st_size);
+        bool ok = read(in, buf.data(), buf.size()) == (ssize_t)buf.size();
+        close(in);
+        size_t len = 0;
+        char * out = ok ? gzip_compress(buf.data(), buf.size(), &len) : NULL;
+        if(out && len < buf.size() * 9 / 10){
+            pack_file v = f;
+            v.enc = ENC_GZIP;
+            v.origin = i;
+            v.data.assign(out, len);
+            v.generated = true;
+            v.st.st_size = len;
+            files.push_back(v);
+        }
+        free(out);
+    }
+}
+
+//映像的布局：描述 | 条目数组 | 哈希表 | 每个文件的元数据 | 保持连接的200响应头 | 文件内容
+//元数据依次是URL、ETag、验证头部、两个304响应和关闭连接的200响应头
+bool static_bundle::pack(const char * root, int fd, off_t streamMin){
+    std::vector<pack_file> files;
+    if(!collect(root, "/", files, streamMin)){
+        return false;
+    }
+    size_t count = files.size();
+    add_variants(files, count);
+
+    bundle_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+    header.version = BUNDLE_VERSION;
+    header.count = files.size();
+    if(!perfect_hash(files, count, header.bits, header.mult)){
+        errno = EOVERFLOW;
+        return false;
+    }
+
+    size_t slotCount = (size_t)1 << header.bits;
+    header.entries = sizeof(bundle_header);
+    header.slots = header.entries + files.size() * sizeof(bundle_entry);
+    uint64_t offset = header.slots + slotCount * sizeof(uint32_t);
+
+    std::vector<bundle_entry> entries(files.size());
+    std::vector<uint32_t> slots(slotCount, 0);
+    std::vector<std::string> meta(files.size());   //URL之后、保持连接的响应头之前的所有内容
+    std::vector<std::string> heads(files.size());  //保持连接的200响应头
+    for(size_t i = 0; i < files.size(); ++i){
+        const pack_file & f = files[i];
+        bundle_entry & e = entries[i];
+        //ETag和文件缓存生成的一致：预压缩文件用它自己的，打包时压缩的用原文件的加后缀
+        char etag[ ETAG_LEN ];
+        int etagLen;
+        time_t mtime = f.st.st_mtime;
+        if(f.enc == ENC_IDENTITY){
+            etagLen = format_etag(etag, f.st);
+        }
+        else {
+            const pack_file & origin = files[ f.origin ];
+            mtime = origin.st.st_mtime;
+            if(f.generated){
+                char originTag[ ETAG_LEN ];
+                int originLen = format_etag(originTag, origin.st);
+                etagLen = format_variant_etag(etag, originTag, originLen, f.enc);
+            }
+            else {
+                etagLen = format_etag(etag, f.st);
+            }
+            entries[ f.origin ].variant[ f.enc ] = i + 1;
+        }
+        char buf[ VALIDATORS_LEN ];
+        std::string validators(buf, format_validators(buf, etag, etagLen, mtime, f.enc, compressible(f.type)));
+
+        std::string & m = meta[i];
+        e.url = offset;
+        e.url_len = f.url.size();
+        m = f.url;
+        e.etag = offset + m.size();
+        e.etag_len = etagLen;
+        m.append(etag, etagLen);
+        e.mtime = mtime;
+        e.type = f.type;
+        e.validators = offset + m.size();
+        e.validators_len = validators.size();
+        m += validators;
+        for(int keep = 0; keep < 2; ++keep){
+            std::string nm = serialize_not_modified(validators, keep);
+            e.not_modified[keep] = offset + m.size();
+            e.not_modified_len[keep] = nm.size();
+            m += nm;
+        }
+        std::string close = serialize_head(f.st.st_size, f.type, validators, 0);
+        e.head[0] = offset + m.size();
+        e.head_len[0] = close.size();
+        m += close;
+        offset += m.size();
+
+        heads[i] = serialize_head(f.st.st_size, f.type, validators, 1);
+        e.head[1] = offset;
+        e.head_len[1] = heads[i].size();
+        offset += heads[i].size();
+
+        e.body = offset;
+        e.body_len = f.st.st_size;
+        offset += f.st.st_size;
+        if(i < count){
+            slots[ slot_of(url_hash(f.url.data(), f.url.size()), header.mult, header.bits) ] = i + 1;
+        }
+    }
+    header.size = offset;
+
+    if(!write_all(fd, (const char *)&header, sizeof(header))
+        || !write_all(fd, (const char *)entries.data(), entries.size() * sizeof(bundle_entry))
+        || !write_all(fd, (const char *)slots.data(), slots.size() * sizeof(uint32_t))){
+        return false;
+    }
+    for(size_t i = 0; i < files.size(); ++i){
+        if(!write_all(fd, meta[i].data(), meta[i].size())
+            || !write_all(fd, heads[i].data(), heads[i].size())
+            || !copy_body(fd, files[i])){
+            return false;
+        }
+    }
+    return true;
+}
+
+static_bundle * static_bundle::instance(){
+    static static_bundle bundle;
+    return &bundle;
+}
+
+static_bundle::static_bundle() : m_base(NULL), m_size(0), m_fd(-1), m_header(NULL), m_entries(NULL), m_slots(NULL), m_streamMin(0) {}
+
+static_bundle::~static_bundle(){
+    //进程退出时才会析构，映射由内核回收
+}
+
+bool static_bundle::build(const char * root, off_t streamMin){
+    int fd = memfd_create("static_bundle", MFD_CLOEXEC);
+    if(fd < 0){
+        return false;
+    }
+    m_streamMin = streamMin;
+    if(!pack(root, fd, streamMin)){
+        int err = errno;
+        close(fd);
+        errno = err;
+        return false;
+    }
+    return attach(fd);
+}
+
+bool static_bundle::load(const char * path, off_t streamMin){
+    m_streamMin = streamMin;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return false;
+    }
+    return attach(fd);
+}
+
+bool static_bundle::attach(int fd){
+    struct stat st;
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(bundle_header)){
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+    size_t size = st.st_size;
+
+    //MAP_POPULATE在启动时就把整个映像读进页表，第一批请求不会缺页
+    void * addr = mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if(addr == MAP_FAILED){
+        close(fd);
+        return false;
+    }
+    //内核允许时用透明大页映射（tmpfs/memfd需要shmem_enabled为advise），失败不影响使用
+    madvise(addr, size, MADV_HUGEPAGE);
+
+    const char * base = (const char *)addr;
+    const bundle_header * header = (const bundle_header *)base;
+    bool ok = memcmp(header->magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) == 0
+        && header->version == BUNDLE_VERSION
+        && header->size == size
+        && header->bits >= 1 && header->bits <= 24
+        && header->entries == sizeof(bundle_header)
+        && header->slots == header->entries + (uint64_t)header->count * sizeof(bundle_entry)
+        && header->slots + ((uint64_t)sizeof(uint32_t) << header->bits) <= size;
+
+    //映像可能来自别的文件，所有偏移都检查一遍，之后发送时不再检查
+    const bundle_entry * entries = (const bundle_entry *)(base + header->entries);
+    const uint32_t * slots = (const uint32_t *)(base + header->slots);
+    for(uint32_t i = 0; ok && i < header->count; ++i){
+        const bundle_entry & e = entries[i];
+        ok = e.url + e.url_len <= size && e.etag + e.etag_len <= size
+            && e.validators + e.validators_len <= size && e.type < TYPE_COUNT
+            && e.not_modified[0] + e.not_modified_len[0] <= size && e.not_modified[1] + e.not_modified_len[1] <= size
+            && e.head[0] + e.head_len[0] <= size
+            && e.head[1] + e.head_len[1] <= size && e.body <= size && e.body_len <= size - e.body;
+        for(int enc = 0; ok && enc < ENC_COUNT; ++enc){
+            ok = e.variant[enc] <= header->count;
+        }
+    }
+    for(size_t i = 0; ok && i < ((size_t)1 << header->bits); ++i){
+        ok = slots[i] <= header->count;
+    }
+    if(!ok){
+        munmap(addr, size);
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+
+    m_base = base;
+    m_size = size;
+    m_fd = fd;
+    m_header = header;
+    m_entries = entries;
+    m_slots = slots;
+    return true;
+}
+
+//一次哈希探测，槽里的条目URL相同才算命中
+const bundle_entry * static_bundle::find(const char * url, size_t len){
+    if(!m_base){
+        return NULL;
+    }
+    uint32_t idx = m_slots[ slot_of(url_hash(url, len), m_header->mult, m_header->bits) ];
+    if(idx == 0){
+        return NULL;
+    }
+    const bundle_entry * e = &m_entries[ idx - 1 ];
+    if(e->url_len != len || memcmp(m_base + e->url, url, len) != 0){
+        return NULL;
+    }
+    //事先打好的包可能是按更大的门限打的，大文件当作不在包里，由文件缓存流式发送
+    if(m_streamMin > 0 && e->body_len >= (uint64_t)m_streamMin){
+        return NULL;
+    }
+    return e;
+}
+
+const bundle_entry * static_bundle::variant(const bundle_entry * entry, unsigned accept){
+    static const ENCODING s_preference[] = { ENC_BR, ENC_GZIP };
+    for(int i = 0; i < 2; ++i){
+        ENCODING enc = s_preference[i];
+        if((accept & (1 << enc)) && entry->variant[enc]){
+            return &m_entries[ entry->variant[enc] - 1 ];
+        }
+    }
+    return NULL;
+}
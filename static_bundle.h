@@ -0,0 +1,91 @@
+#ifndef STATICBUNDLE_H
+#define STATICBUNDLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "http_response.h"
+
+//【静态资源包】把doc_root下的所有文件打包成一个连续的映像，启动时整个映射进内存
+//映像里每个文件带着预先序列化好的200和304响应头，URL到文件的索引是完美哈希表：
+//命中时只要一次哈希探测，响应头和文件内容都直接从映像发送，不拼路径、不stat、不open
+//映像可以在启动时现打（放在memfd里），也可以事先用tools/pack_bundle.cpp打成文件再加载
+//文本类的文件带着压缩版本(旁边的.br/.gz，或者打包时压缩的gzip)，也是映像里的条目，但不进哈希表
+
+//映像开头的描述
+struct bundle_header {
+    char magic[ 8 ];        //"WSBUNDLE"
+    uint32_t version;
+    uint32_t count;         //文件数
+    uint32_t bits;          //哈希表有2^bits个槽
+    uint32_t reserved;
+    uint64_t mult;          //完美哈希的乘数
+    uint64_t entries;       //条目数组在映像中的偏移
+    uint64_t slots;         //哈希表在映像中的偏移
+    uint64_t size;          //映像的总长度
+};
+
+//一个文件，所有位置都是相对映像开头的偏移
+//保持连接的响应头紧挨着文件内容，writev发送时两段合成一段
+struct bundle_entry {
+    uint64_t url;           //URL，如"/index.html"
+    uint32_t url_len;
+    uint32_t etag_len;
+    uint64_t etag;          //带引号的ETag，和文件缓存生成的相同
+    int64_t mtime;          //修改时间，比较If-Modified-Since用
+    uint32_t head_len[ 2 ]; //200响应头的长度，下标为是否保持连接
+    uint64_t head[ 2 ];     //200响应头，带验证头部
+    uint32_t not_modified_len[ 2 ];
+    uint64_t not_modified[ 2 ]; //完整的304响应
+    uint64_t validators;    //验证头部，生成206响应头时用
+    uint32_t validators_len;
+    uint32_t type;          //CONTENT_TYPE
+    uint64_t body;          //文件内容
+    uint64_t body_len;
+    uint32_t variant[ ENC_COUNT ];  //各编码的压缩版本的条目下标加1，0为没有
+};
+
+class static_bundle {
+public:
+    static static_bundle * instance();
+
+    //把root目录下所有其他人可读的普通文件打包写进fd，成功返回true
+    //不小于streamMin字节的大文件不打包，由文件缓存流式发送；0为不区分
+    static bool pack(const char * root, int fd, off_t streamMin);
+
+    //启动时打包root目录，映像放在memfd里；streamMin和文件缓存的大文件门限相同
+    bool build(const char * root, off_t streamMin);
+
+    //加载事先打好的映像文件，包里不小于streamMin字节的文件查找时当作不在包里
+    bool load(const char * path, off_t streamMin);
+
+    bool active() { return m_base != NULL; }
+
+    //按URL查找文件，不在包里返回NULL
+    const bundle_entry * find(const char * url, size_t len);
+
+    //从accept(按位的编码集合)中选一个条目有的压缩版本，br优先；都没有返回NULL
+    const bundle_entry * variant(const bundle_entry * entry, unsigned accept);
+
+    //映像在内存中的起始位置和描述符，发送时按条目里的偏移取数据
+    const char * base() { return m_base; }
+    int fd() { return m_fd; }
+
+private:
+    static_bundle();
+    ~static_bundle();
+
+    //映射fd中的映像并检查格式，fd由本对象接管
+    bool attach(int fd);
+
+private:
+    const char * m_base;
+    size_t m_size;
+    int m_fd;
+    const bundle_header * m_header;
+    const bundle_entry * m_entries;
+    const uint32_t * m_slots;   //条目下标加1，0为空槽
+    off_t m_streamMin;          //大文件的门限，0为不区分
+};
+
+#endif
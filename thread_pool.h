@@ -1,20 +1,26 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
 #include <cstdio>
+#include <atomic>
 #include <exception>
 #include <pthread.h>
 #include "locker.h"
+#include "work_queue.h"
+#include "log.h"
 
 //线程池类，定义为模板类，便于代码的复用，模板参数T为任务类
-template<typename T>
+//Queue为请求队列的策略，默认是无锁环形队列，也可以换成locked_queue<T>或工作窃取的ws_queue<T>
+template<typename T, typename Queue = mpmc_queue<T> >
 class threadPool{ 
 public:
     threadPool(int threadNum = 8, int maxReqsts = 10000);
 
     bool append(T* request);
 
+    //队列中等待处理的请求数（近似值）
+    size_t size() { return m_workQueue.size(); }
+
     ~threadPool();
 
 private:
@@ -32,22 +38,19 @@ private:
     int m_maxReqsts;
 
     //请求队列
-    std::list<T*> m_workQueue;
-
-    //互斥锁
-    locker m_queueLocker;
+    Queue m_workQueue;
 
-    //信号量：判断是否有任务要处理
-    sem m_queueStat;
+    //给工作线程分配编号
+    std::atomic<int> m_workerSeq;
 
     //是否结束线程
     bool m_stop;
 };
 
-template<typename T>
-threadPool<T>::threadPool(int threadNum, int maxReqsts) :
+template<typename T, typename Queue>
+threadPool<T, Queue>::threadPool(int threadNum, int maxReqsts) :
     m_threadNum(threadNum), m_maxReqsts(maxReqsts), 
-    m_stop(false), m_threads(NULL) {
+    m_stop(false), m_threads(NULL), m_workQueue(maxReqsts, threadNum), m_workerSeq(0) {
 
         if(threadNum <= 0 || maxReqsts <= 0){
             throw std::exception();
@@ -60,7 +63,7 @@ threadPool<T>::threadPool(int threadNum, int maxReqsts) :
 
         //创建threadNum个线程，并设置为线程脱离
         for(int i = 0; i<threadNum; ++i){
-            printf("创建第 %d 个线程\n", i);
+            LOG_INFO("创建第 %d 个线程", i);
 
             if(pthread_create(m_threads + i, NULL, work, this) != 0){ //work作为静态成员不能访问非静态成员，因此最后一个参数用this
                 delete [] m_threads;
@@ -74,50 +77,34 @@ threadPool<T>::threadPool(int threadNum, int maxReqsts) :
         }
     }
 
-template<typename T>
-threadPool<T>::~threadPool(){
+template<typename T, typename Queue>
+threadPool<T, Queue>::~threadPool(){
     delete [] m_threads;
     m_stop = true;
+    m_workQueue.stop();
 }
 
-template<typename T>
-bool threadPool<T>::append(T* request){
-    // 操作工作队列时一定要加锁，因为它被所有线程共享
-    m_queueLocker.lock();
-    //超出最大请求数量，报错
-    if(m_workQueue.size() > m_maxReqsts){
-        m_queueLocker.unlock();
-        return false;
-    }
-
-    m_workQueue.push_back(request);
-    m_queueLocker.unlock();
-    m_queueStat.post();
-    return true;
+template<typename T, typename Queue>
+bool threadPool<T, Queue>::append(T* request){
+    //超出最大请求数量时队列返回false
+    return m_workQueue.push(request);
 }
 
-template<typename T>
-void *threadPool<T>::work(void* arg){
+template<typename T, typename Queue>
+void *threadPool<T, Queue>::work(void* arg){
     threadPool * pool = (threadPool *) arg;
     pool->run();
     return pool;
 }
 
-template<typename T>
-void threadPool<T>::run(){
+template<typename T, typename Queue>
+void threadPool<T, Queue>::run(){
+    //本线程的编号，工作窃取队列据此找到自己的队列
+    int worker = m_workerSeq++;
     
     while(!m_stop){
-        m_queueStat.wait();
-        m_queueLocker.lock();
-        if(m_workQueue.empty()){ //队列满了->退出
-            m_queueLocker.unlock();
-            continue;
-        }
-
-        T* request = m_workQueue.front();
-        m_workQueue.pop_front();
-        m_queueLocker.unlock();
-
+        //队列为空时阻塞在这里
+        T* request = m_workQueue.pop(worker);
         if(!request){
             continue;
         }
@@ -0,0 +1,147 @@
+#include "timer_wheel.h"
+#include <time.h>
+
+timer_wheel::timer_wheel(int tickMs) :
+    m_tickMs(tickMs), m_startMs(now()), m_ticks(0), m_count(0) {
+
+    for(int i = 0; i < TVR_SIZE; ++i){
+        m_tv1[i].prev = m_tv1[i].next = &m_tv1[i];
+    }
+    for(int l = 0; l < LEVELS; ++l){
+        for(int i = 0; i < TVN_SIZE; ++i){
+            m_tvn[l][i].prev = m_tvn[l][i].next = &m_tvn[l][i];
+        }
+    }
+}
+
+uint64_t timer_wheel::now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel::link(timer_node * head, timer_node * node){
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+void timer_wheel::unlink(timer_node * node){
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+}
+
+//按到期时间与当前tick的距离选择层和槽
+void timer_wheel::place(timer_node * node){
+    uint64_t expire = node->expire;
+    uint64_t idx = expire - m_ticks;
+
+    if(idx < (uint64_t)TVR_SIZE){
+        link(&m_tv1[ expire & TVR_MASK ], node);
+        return;
+    }
+    for(int l = 0; l < LEVELS; ++l){
+        int shift = TVR_BITS + l * TVN_BITS;
+        if(idx < ((uint64_t)1 << (shift + TVN_BITS)) || l == LEVELS - 1){
+            if(idx >= ((uint64_t)1 << (shift + TVN_BITS))){
+                //超出时间轮的范围，先放在最远的位置，到时再重新分散
+                expire = m_ticks + ((uint64_t)1 << (shift + TVN_BITS)) - 1;
+            }
+            link(&m_tvn[l][ (expire >> shift) & TVN_MASK ], node);
+            return;
+        }
+    }
+}
+
+void timer_wheel::add(timer_node * node, int timeoutMs, int type){
+    if(node->pending()){
+        unlink(node);
+        --m_count;
+    }
+
+    uint64_t expire = (now() - m_startMs + timeoutMs + m_tickMs - 1) / m_tickMs;
+    if(expire < m_ticks){
+        expire = m_ticks;
+    }
+    node->expire = expire;
+    node->type = type;
+    place(node);
+    ++m_count;
+}
+
+void timer_wheel::del(timer_node * node){
+    if(node->pending()){
+        unlink(node);
+        --m_count;
+    }
+}
+
+//把上层一个槽中的定时器重新分散到下层，返回槽下标，为0表示上层也转完了一圈
+int timer_wheel::cascade(int level, int index){
+    timer_node * head = &m_tvn[level][index];
+    timer_node * node = head->next;
+    head->prev = head->next = head;
+
+    while(node != head){
+        timer_node * next = node->next;
+        place(node);
+        node = next;
+    }
+    return index;
+}
+
+int timer_wheel::timeout(uint64_t nowMs){
+    if(m_count == 0){
+        return -1;
+    }
+
+    //在第一层中找下一个非空的槽，到了第一层一圈的末尾必须醒来做cascade
+    uint64_t tick = m_ticks;
+    do {
+        if(m_tv1[ tick & TVR_MASK ].next != &m_tv1[ tick & TVR_MASK ]){
+            break;
+        }
+        ++tick;
+    } while(tick & TVR_MASK);
+
+    uint64_t wake = m_startMs + tick * m_tickMs;
+    return wake > nowMs ? (int)(wake - nowMs) : 0;
+}
+
+timer_node * timer_wheel::expire(uint64_t nowMs){
+    uint64_t target = (nowMs - m_startMs) / m_tickMs;
+    timer_node * expired = NULL;
+    timer_node ** tail = &expired;
+
+    while(m_ticks <= target){
+        if(m_count == 0){
+            //轮是空的，直接跳到当前时刻
+            m_ticks = target + 1;
+            break;
+        }
+
+        int index = m_ticks & TVR_MASK;
+        if(index == 0){
+            for(int l = 0; l < LEVELS; ++l){
+                if(cascade(l, (m_ticks >> (TVR_BITS + l * TVN_BITS)) & TVN_MASK) != 0){
+                    break;
+                }
+            }
+        }
+        ++m_ticks;
+
+        //把这个槽里的定时器全部摘下，串到结果链表上
+        timer_node * head = &m_tv1[index];
+        while(head->next != head){
+            timer_node * node = head->next;
+            unlink(node);
+            --m_count;
+            *tail = node;
+            tail = &node->next;
+        }
+    }
+    *tail = NULL;
+    return expired;
+}
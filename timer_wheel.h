@@ -0,0 +1,73 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//【分层时间轮】增加、删除定时器都是O(1)，不分配内存；到期的定时器一次批量取出
+//第一层256个槽，每槽一个tick；后三层各64个槽，每槽覆盖下一层转一圈的时间，
+//低层转完一圈时把上一层对应槽里的定时器重新分散到低层（cascade）。
+//时间轮不是线程安全的，只能在拥有它的事件循环线程中使用
+
+//定时器节点，嵌入到需要定时的对象中，挂在时间轮的槽上（侵入式双向链表）
+struct timer_node {
+    timer_node * prev;
+    timer_node * next;
+    uint64_t expire;    //到期的tick
+    int type;           //定时器类型，由使用者解释
+    void * data;        //定时器所属的对象
+
+    timer_node() : prev(NULL), next(NULL), expire(0), type(0), data(NULL) {}
+
+    //是否挂在时间轮上
+    bool pending() const { return prev != NULL; }
+};
+
+class timer_wheel {
+public:
+    timer_wheel(int tickMs = 100);
+
+    //在timeoutMs毫秒后到期，节点已在轮上时先摘下再重新挂上
+    void add(timer_node * node, int timeoutMs, int type);
+
+    //删除定时器，节点不在轮上时什么也不做
+    void del(timer_node * node);
+
+    //距离下一次需要处理定时器还有多少毫秒，可直接作为epoll_wait的超时，没有定时器时返回-1
+    int timeout(uint64_t nowMs);
+
+    //推进到nowMs，返回所有到期节点组成的单链表（通过next串起来，节点已不在轮上）
+    //遍历时先保存next再处理节点，处理过程中可以把节点重新加入时间轮
+    timer_node * expire(uint64_t nowMs);
+
+    int tickMs() const { return m_tickMs; }
+
+    //单调时钟，单位毫秒
+    static uint64_t now();
+
+private:
+    static const int TVR_BITS = 8;
+    static const int TVN_BITS = 6;
+    static const int TVR_SIZE = 1 << TVR_BITS;
+    static const int TVN_SIZE = 1 << TVN_BITS;
+    static const int TVR_MASK = TVR_SIZE - 1;
+    static const int TVN_MASK = TVN_SIZE - 1;
+    static const int LEVELS = 3;
+
+    void place(timer_node * node);
+    int cascade(int level, int index);
+    static void link(timer_node * head, timer_node * node);
+    static void unlink(timer_node * node);
+
+private:
+    //每个槽是一个带哨兵的循环链表
+    timer_node m_tv1[ TVR_SIZE ];
+    timer_node m_tvn[ LEVELS ][ TVN_SIZE ];
+
+    int m_tickMs;
+    uint64_t m_startMs;     //第0个tick对应的时刻
+    uint64_t m_ticks;       //下一个要处理的tick
+    int m_count;            //轮上的定时器数量
+};
+
+#endif
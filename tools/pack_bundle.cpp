@@ -0,0 +1,48 @@
+// 静态资源包打包工具：把网站根目录打成一个映像文件，服务器用 -B 加载，启动时不用再扫描目录
+// 编译: g++ -O2 tools/pack_bundle.cpp static_bundle.cpp http_response.cpp -lz -o pack_bundle
+// 运行: ./pack_bundle [网站根目录(默认./resources)] [输出文件(默认resources.bundle)] [Cache-Control的max-age秒数(默认3600)] [大文件门限MB(默认64，0为不区分)]
+// 包里的响应头是打包时生成的，max-age以打包时给的为准，服务器的 -m 参数对加载的包不起作用
+// 不小于门限的大文件不打包；服务器的 -S 比打包时的门限小时，包里超过 -S 的文件也不从包里发送
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../static_bundle.h"
+#include "../http_response.h"
+
+int main(int argc, char * argv[]){
+    const char * root = argc > 1 ? argv[1] : "./resources";
+    const char * out = argc > 2 ? argv[2] : "resources.bundle";
+    if(argc > 3){
+        g_max_age = atoi(argv[3]);
+    }
+    off_t streamMin = (off_t)(argc > 4 ? atoi(argv[4]) : 64) << 20;
+
+    //先写到临时文件再改名，正在运行的服务器映射着的旧文件不受影响
+    char tmp[ 4096 ];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0){
+        fprintf(stderr, "创建%s失败, errno is: %d\n", tmp, errno);
+        return 1;
+    }
+    if(!static_bundle::pack(root, fd, streamMin) || fsync(fd) < 0){
+        fprintf(stderr, "打包%s失败, errno is: %d\n", root, errno);
+        close(fd);
+        unlink(tmp);
+        return 1;
+    }
+    close(fd);
+    if(rename(tmp, out) < 0){
+        fprintf(stderr, "改名为%s失败, errno is: %d\n", out, errno);
+        unlink(tmp);
+        return 1;
+    }
+
+    struct stat st;
+    stat(out, &st);
+    printf("%s -> %s, %lld bytes\n", root, out, (long long)st.st_size);
+    return 0;
+}
@@ -0,0 +1,526 @@
+#include "uring_backend.h"
+#include "http_conn.h"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <exception>
+
+static_assert(alignof(http_conn) >= 8, "user_data的低3位用来存放操作种类");
+
+static inline uint64_t tag(http_conn * conn, int op){
+    return (uint64_t)(uintptr_t)conn | op;
+}
+
+uring_backend::uring_backend(int id, int listenFd, http_conn * users, bool (*dispatch)(http_conn *)) :
+    io_backend(id, listenFd, users, dispatch),
+    m_ringFd(-1), m_disabled(false), m_sqRing(MAP_FAILED), m_sqRingSize(0), m_sqes((io_uring_sqe *)MAP_FAILED), m_sqesSize(0),
+    m_bufs(NULL), m_acceptArmed(false),
+    m_wakeFd(-1), m_wakeVal(0), m_notified(false), m_readq(NULL), m_writeq(NULL) {
+
+    m_readq = new mpmc_queue<http_conn>(INBOX_SIZE);
+    m_writeq = new mpmc_queue<http_conn>(INBOX_SIZE);
+    m_wakeFd = eventfd(0, EFD_CLOEXEC);
+    if(m_wakeFd < 0 || !setup()){
+        teardown();
+        throw std::exception();
+    }
+}
+
+uring_backend::~uring_backend(){
+    teardown();
+}
+
+void uring_backend::teardown(){
+    if(m_sqes != MAP_FAILED){
+        munmap(m_sqes, m_sqesSize);
+    }
+    if(m_sqRing != MAP_FAILED){
+        munmap(m_sqRing, m_sqRingSize);
+    }
+    if(m_ringFd != -1){
+        close(m_ringFd);
+    }
+    if(m_wakeFd != -1){
+        close(m_wakeFd);
+    }
+    free(m_bufs);
+    delete m_readq;
+    delete m_writeq;
+    m_sqes = (io_uring_sqe *)MAP_FAILED;
+    m_sqRing = MAP_FAILED;
+    m_ringFd = m_wakeFd = -1;
+    m_bufs = NULL;
+    m_readq = m_writeq = NULL;
+}
+
+//建立io_uring，映射提交队列和完成队列；内核不支持时返回false
+bool uring_backend::setup(){
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    //只有事件循环线程提交，完成事件推迟到它调用io_uring_enter时才处理，减少中断上下文里的工作；
+    //ring先以禁用状态建立，由事件循环线程启用，它才是唯一的提交者
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED;
+    p.cq_entries = RING_ENTRIES * 4;
+    m_ringFd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    m_disabled = true;
+    if(m_ringFd < 0 && errno == EINVAL){
+        //6.1之前的内核不支持这些标志
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = RING_ENTRIES * 4;
+        m_ringFd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+        m_disabled = false;
+    }
+
+    bool ok = m_ringFd >= 0 && (p.features & IORING_FEAT_SINGLE_MMAP) && (p.features & IORING_FEAT_EXT_ARG);
+    if(ok){
+        size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        m_sqRingSize = sqSize > cqSize ? sqSize : cqSize;
+        m_sqRing = mmap(NULL, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+        m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = (io_uring_sqe *)mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES);
+        ok = m_sqRing != MAP_FAILED && m_sqes != MAP_FAILED;
+    }
+    if(ok){
+        char * base = (char *)m_sqRing;
+        m_sqHead = (unsigned *)(base + p.sq_off.head);
+        m_sqTail = (unsigned *)(base + p.sq_off.tail);
+        m_sqMask = *(unsigned *)(base + p.sq_off.ring_mask);
+        m_sqEntries = *(unsigned *)(base + p.sq_off.ring_entries);
+        //sqe数组和提交队列一一对应，下标数组只需要填一次
+        unsigned * array = (unsigned *)(base + p.sq_off.array);
+        for(unsigned i = 0; i < m_sqEntries; ++i){
+            array[i] = i;
+        }
+        m_sqLocalTail = *m_sqTail;
+
+        m_cqHead = (unsigned *)(base + p.cq_off.head);
+        m_cqTail = (unsigned *)(base + p.cq_off.tail);
+        m_cqMask = *(unsigned *)(base + p.cq_off.ring_mask);
+        m_cqes = (io_uring_cqe *)(base + p.cq_off.cqes);
+
+        //接收缓冲区组：内核接收数据时从这里取一个缓冲区，完成事件里带着它的编号
+        m_bufs = (char *)malloc((size_t)BUF_COUNT * BUF_SIZE);
+        ok = m_bufs != NULL;
+    }
+    return ok;
+}
+
+//把从编号bid开始的count个接收缓冲区交给内核，成功时不产生完成事件
+void uring_backend::provide(int bid, int count){
+    io_uring_sqe * sqe = get_sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uint64_t)(uintptr_t)(m_bufs + (size_t)bid * BUF_SIZE);
+    sqe->len = BUF_SIZE;
+    sqe->off = bid;
+    sqe->buf_group = BUF_GROUP;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = tag(NULL, OP_PROVIDE);
+}
+
+//取一个空闲的sqe，提交队列满了先把已经填好的提交掉
+io_uring_sqe * uring_backend::get_sqe(){
+    if(m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries){
+        submit_only();
+    }
+    io_uring_sqe * sqe = &m_sqes[ m_sqLocalTail & m_sqMask ];
+    ++m_sqLocalTail;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+//提交填好的sqe，wait不为0时等待至少wait个完成事件，最多等timeoutMs毫秒(-1为不限)
+int uring_backend::enter(unsigned submit, unsigned wait, int timeoutMs){
+    __atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+
+    unsigned flags = 0;
+    io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    memset(&arg, 0, sizeof(arg));
+    if(wait){
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if(timeoutMs >= 0){
+            ts.tv_sec = timeoutMs / 1000;
+            ts.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    return syscall(__NR_io_uring_enter, m_ringFd, submit, wait, flags, wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+}
+
+void uring_backend::submit_only(){
+    enter(m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE), 0, -1);
+}
+
+//监听socket上的multishot accept，直到内核停止它(比如fd用完了)才需要重新提交
+//多个完成事件共用一个地址缓冲区会互相覆盖，因此不取对端地址
+void uring_backend::arm_accept(){
+    io_uring_sqe * sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenFd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = tag(NULL, OP_ACCEPT);
+    m_acceptArmed = true;
+}
+
+//过载时取消multishot accept，最后一个accept完成事件到来时才真正停下
+void uring_backend::cancel_accept(){
+    io_uring_sqe * sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = tag(NULL, OP_ACCEPT);
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = tag(NULL, OP_NONE);
+}
+
+//读eventfd，工作线程写它来唤醒事件循环
+void uring_backend::arm_wake(){
+    io_uring_sqe * sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_wakeFd;
+    sqe->addr = (uint64_t)(uintptr_t)&m_wakeVal;
+    sqe->len = sizeof(m_wakeVal);
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = tag(NULL, OP_WAKE);
+}
+
+//等待连接上的下一批数据，最多读到读缓冲区放得下为止
+void uring_backend::arm_recv(http_conn * conn){
+    int space = http_conn::READ_BUF_SIZE - 1 - conn->m_read_index;
+    if(space <= 0){
+        //请求太长，读缓冲区放不下
+        conn->close_conn();
+        return;
+    }
+    if(space > BUF_SIZE){
+        space = BUF_SIZE;
+    }
+    io_uring_sqe * sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->m_sockFd;
+    sqe->len = space;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = tag(conn, OP_RECV);
+    ++conn->m_inflight;
+}
+
+//提交发送队列里的下一步：连续的内存段一次sendmsg，文件段经管道splice到socket
+void uring_backend::send_next(http_conn * conn){
+    if(conn->bytes_to_send == 0){
+        finish_write(conn);
+        return;
+    }
+
+    //对方迟迟不收数据时关闭连接，每次有进展都重新计时
+    m_timers->add(&conn->m_timer, http_conn::WRITE_TIMEOUT, http_conn::TIMER_WRITE);
+
+    //一条链要一起提交，先保证提交队列里放得下
+    if(m_sqEntries - (m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE)) < 3){
+        submit_only();
+    }
+
+    http_conn::segment * segs = conn->m_buf->segs;
+    int i = conn->m_seg_head;
+    int sockFd = conn->m_sockFd;
+
+    if(conn->m_pipe_bytes == 0 && segs[i].base){
+        struct iovec * iv = conn->m_buf->iv;
+        int n = 0;
+        for( ; i < conn->m_seg_count && segs[i].base; ++i, ++n){
+            iv[n].iov_base = (void *)segs[i].base;
+            iv[n].iov_len = segs[i].len;
+        }
+        bool fileNext = i < conn->m_seg_count;
+        if(fileNext && conn->m_pipe[0] == -1 && pipe2(conn->m_pipe, O_CLOEXEC) < 0){
+            conn->close_conn();
+            return;
+        }
+
+        struct msghdr * msg = &conn->m_buf->msg;
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_iov = iv;
+        msg->msg_iovlen = n;
+
+        io_uring_sqe * sqe = get_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = sockFd;
+        sqe->addr = (uint64_t)(uintptr_t)msg;
+        sqe->len = 1;
+        //MSG_WAITALL让内核发完才算完成，链上后面的文件内容不会插进响应头中间
+        sqe->msg_flags = MSG_WAITALL | (fileNext ? MSG_MORE : 0);
+        sqe->flags = fileNext ? IOSQE_IO_LINK : 0;
+        sqe->user_data = tag(conn, OP_SEND);
+        ++conn->m_inflight;
+        if(!fileNext){
+            return;
+        }
+    }
+    else if(conn->m_pipe[0] == -1 && pipe2(conn->m_pipe, O_CLOEXEC) < 0){
+        conn->close_conn();
+        return;
+    }
+
+    io_uring_sqe * sqe;
+    unsigned len = conn->m_pipe_bytes;
+    if(len == 0){
+        //文件 -> 管道，最多一个管道的容量
+        http_conn::segment & seg = segs[i];
+        len = seg.len < (size_t)PIPE_CHUNK ? seg.len : PIPE_CHUNK;
+        sqe = get_sqe();
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = conn->m_pipe[1];
+        sqe->off = (uint64_t)-1;
+        sqe->splice_fd_in = seg.fd;
+        sqe->splice_off_in = seg.offset;
+        sqe->len = len;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = tag(conn, OP_SPLICE_IN);
+        ++conn->m_inflight;
+    }
+
+    //管道 -> socket；上一次没发完的留在管道里，这一次接着发
+    sqe = get_sqe();
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = sockFd;
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = conn->m_pipe[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->len = len;
+    sqe->user_data = tag(conn, OP_SPLICE_OUT);
+    ++conn->m_inflight;
+}
+
+//一批响应发完了，和epoll后端的EPOLLOUT处理相同
+void uring_backend::finish_write(http_conn * conn){
+    if(!conn->write_done()){
+        conn->close_conn();
+    }
+    else if(conn->pipelined()){
+        dispatch(conn);
+    }
+}
+
+void uring_backend::sent(http_conn * conn, int bytes){
+    conn->bytes_have_send += bytes;
+    conn->bytes_to_send -= bytes;
+    conn->advance(bytes);
+}
+
+void uring_backend::on_recv(http_conn * conn, int res, unsigned flags){
+    --conn->m_inflight;
+    int bid = (res > 0 && (flags & IORING_CQE_F_BUFFER)) ? (int)(flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+
+    if(conn->m_closing){
+        if(bid >= 0){
+            provide(bid, 1);
+        }
+        if(conn->m_inflight == 0){
+            conn->release();
+        }
+        return;
+    }
+    if(res == -ENOBUFS){
+        //接收缓冲区暂时用完了，下一轮再读
+        arm_recv(conn);
+        return;
+    }
+    if(res <= 0 || bid < 0){
+        //对方关闭连接或出错
+        conn->close_conn();
+        return;
+    }
+
+    bool ok = conn->feed(m_bufs + (size_t)bid * BUF_SIZE, res);
+    provide(bid, 1);
+    if(ok){
+        dispatch(conn);
+    }
+    else {
+        conn->close_conn();
+    }
+}
+
+void uring_backend::on_write(http_conn * conn, int op, int res){
+    --conn->m_inflight;
+    if(conn->m_closing){
+        if(conn->m_inflight == 0){
+            conn->release();
+        }
+        return;
+    }
+
+    if(res == -ECANCELED){
+        //链上前一个操作没有全部完成，这一个没有执行，等链结束后从记录的进度重新开始
+    }
+    else if(res <= 0){
+        conn->close_conn();
+        return;
+    }
+    else if(op == OP_SPLICE_IN){
+        conn->m_pipe_bytes += res;
+    }
+    else if(op == OP_SPLICE_OUT){
+        conn->m_pipe_bytes -= res;
+        conn->m_buf->segs[ conn->m_seg_head ].offset += res;
+        sent(conn, res);
+    }
+    else {
+        sent(conn, res);
+    }
+
+    if(conn->m_inflight == 0){
+        send_next(conn);
+    }
+}
+
+void uring_backend::reap(){
+    unsigned head = *m_cqHead;
+    unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    while(head != tail){
+        io_uring_cqe cqe = m_cqes[ head & m_cqMask ];
+        ++head;
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+
+        int op = cqe.user_data & 7;
+        http_conn * conn = (http_conn *)(uintptr_t)(cqe.user_data & ~(uint64_t)7);
+        switch(op){
+            case OP_ACCEPT:
+                if(cqe.res >= 0){
+                    struct sockaddr_in addr;
+                    memset(&addr, 0, sizeof(addr));
+                    accepted(cqe.res, addr);
+                }
+                else if(cqe.res != -ECANCELED){
+                    LOG_WARN("accept errno is: %d", -cqe.res);
+                }
+                if(!(cqe.flags & IORING_CQE_F_MORE)){
+                    //暂停期间不再提交，恢复时重新提交
+                    m_acceptArmed = false;
+                    if(!m_paused){
+                        arm_accept();
+                    }
+                }
+                break;
+            case OP_NONE:
+                break;
+            case OP_PROVIDE:
+                LOG_ERROR("io_uring provide buffers failed: %d", -cqe.res);
+                break;
+            case OP_WAKE:
+                //先清掉标志再处理收件箱，之后提交的连接一定会再次唤醒
+                m_notified.store(false);
+                arm_wake();
+                break;
+            case OP_RECV:
+                on_recv(conn, cqe.res, cqe.flags);
+                break;
+            default:
+                on_write(conn, op, cqe.res);
+                break;
+        }
+    }
+}
+
+//处理工作线程交回的连接：先把m_busy减一，之后定时器才能关闭它
+void uring_backend::drain(){
+    http_conn * conn;
+    while(m_readq->tryPop(conn)){
+        conn->returned();
+        if(conn->m_sockFd != -1){
+            arm_recv(conn);
+        }
+    }
+    while(m_writeq->tryPop(conn)){
+        conn->returned();
+        if(conn->m_sockFd != -1){
+            send_next(conn);
+        }
+    }
+}
+
+void uring_backend::add(http_conn * conn){
+    arm_recv(conn);
+}
+
+void uring_backend::rearm(http_conn * conn, int ev){
+    if(ev & EPOLLOUT){
+        send_next(conn);
+    }
+    else {
+        arm_recv(conn);
+    }
+}
+
+//放进收件箱，必要时唤醒事件循环
+void uring_backend::hand_back(http_conn * conn, int ev){
+    mpmc_queue<http_conn> * q = (ev & EPOLLOUT) ? m_writeq : m_readq;
+    while(!q->tryPush(conn)){
+        cpuRelax();
+    }
+    if(!m_notified.exchange(true)){
+        uint64_t one = 1;
+        ssize_t ret = ::write(m_wakeFd, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+void uring_backend::remove(http_conn * conn){
+    if(conn->m_closing){
+        return;
+    }
+    if(conn->m_inflight == 0){
+        conn->release();
+        return;
+    }
+    //还有操作在进行，内核可能还在访问连接的缓冲区；shutdown让它们尽快结束，最后一个完成时再释放
+    conn->m_closing = true;
+    shutdown(conn->m_sockFd, SHUT_RDWR);
+}
+
+void uring_backend::run(){
+    if(m_disabled && syscall(__NR_io_uring_register, m_ringFd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0){
+        LOG_ERROR("io_uring failure");
+        return;
+    }
+
+    provide(0, BUF_COUNT);
+    arm_accept();
+    arm_wake();
+    while(1){
+        //线程池积压时不再接收新连接，让它们留在内核的accept队列里
+        if(update_admission()){
+            if(m_paused){
+                cancel_accept();
+            }
+            else if(!m_acceptArmed){
+                arm_accept();
+            }
+        }
+
+        drain();
+
+        //提交这一轮的所有操作，并等到有完成事件或下一个定时器需要处理为止
+        unsigned submit = m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        unsigned wait = (*m_cqHead == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) ? 1 : 0;
+        int ret = enter(submit, wait, wait_timeout());
+        if(ret < 0 && errno != EINTR && errno != ETIME && errno != EBUSY){
+            LOG_ERROR("io_uring failure");
+            break;
+        }
+
+        reap();
+        expire_timers();
+    }
+}
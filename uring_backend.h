@@ -0,0 +1,98 @@
+#ifndef URINGBACKEND_H
+#define URINGBACKEND_H
+
+#include <atomic>
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include "io_backend.h"
+#include "work_queue.h"
+
+//【io_uring后端】不用liburing，直接通过系统调用建立提交队列和完成队列
+//  - 监听socket上挂一个multishot accept，一次提交持续接收新连接
+//  - 读请求用带缓冲区选择的recv：缓冲区来自事先提供给内核的缓冲区组，数据到了才占用，拷进连接的读缓冲区后
+//    随下一次提交立即归还，等待请求的空闲连接不需要读缓冲区
+//  - 发送响应：连续的内存段(响应头、mmap的文件)一次sendmsg；sendfile方式下文件内容通过管道splice到socket，
+//    响应头的sendmsg和两次splice用IOSQE_IO_LINK串成一条链一起提交
+//  - 工作线程处理完请求后把连接放进本循环的收件箱，用eventfd唤醒；事件循环在一次io_uring_enter里
+//    提交所有操作并等待完成，稳定运行时每批请求只有这一次系统调用
+//每个连接同一时刻只有一个读操作或一条发送链在进行，关闭连接时先shutdown，等操作都完成后再释放
+class uring_backend : public io_backend {
+public:
+    //内核不支持需要的特性时抛出异常
+    uring_backend(int id, int listenFd, http_conn * users, bool (*dispatch)(http_conn *));
+    ~uring_backend();
+
+    void run();
+    void add(http_conn * conn);
+    void rearm(http_conn * conn, int ev);
+    void hand_back(http_conn * conn, int ev);
+    void remove(http_conn * conn);
+
+private:
+    //提交的操作种类，和连接的地址一起编码在user_data里(http_conn按8字节对齐，低3位空闲)
+    //OP_NONE是不关心结果的操作，成功时不产生完成事件
+    enum OP { OP_NONE = 0, OP_ACCEPT, OP_WAKE, OP_RECV, OP_SEND, OP_SPLICE_IN, OP_SPLICE_OUT, OP_PROVIDE };
+
+    static const unsigned RING_ENTRIES = 4096;  //提交队列的长度，完成队列是它的4倍
+    static const int BUF_COUNT = 1024;          //接收缓冲区的数量
+    static const int BUF_SIZE = 2048;           //每个接收缓冲区的大小，和连接的读缓冲区一样大
+    static const int BUF_GROUP = 0;
+    static const int PIPE_CHUNK = 65536;        //一次splice经过管道的最大字节数，即管道的默认容量
+    static const int INBOX_SIZE = 16384;        //工作线程提交给事件循环的收件箱容量
+
+    bool setup();
+    void teardown();
+    io_uring_sqe * get_sqe();
+    int enter(unsigned submit, unsigned wait, int timeoutMs);
+    void submit_only();
+
+    void arm_accept();
+    void cancel_accept();
+    void arm_wake();
+    void arm_recv(http_conn * conn);
+    void send_next(http_conn * conn);
+    void finish_write(http_conn * conn);
+    void drain();
+
+    void reap();
+    void on_recv(http_conn * conn, int res, unsigned flags);
+    void on_write(http_conn * conn, int op, int res);
+    void sent(http_conn * conn, int bytes);
+    void provide(int bid, int count);
+
+private:
+    int m_ringFd;
+    bool m_disabled;            //以IORING_SETUP_R_DISABLED建立，需要在事件循环线程里启用
+
+    //提交队列
+    void * m_sqRing;
+    size_t m_sqRingSize;
+    unsigned * m_sqHead;
+    unsigned * m_sqTail;
+    unsigned m_sqMask;
+    unsigned m_sqEntries;
+    io_uring_sqe * m_sqes;
+    size_t m_sqesSize;
+    unsigned m_sqLocalTail;     //已经填好、还没提交的sqe的末尾
+    unsigned m_sqSubmitted;     //已经提交给内核的sqe的末尾
+
+    //完成队列，和提交队列共用一次映射
+    unsigned * m_cqHead;
+    unsigned * m_cqTail;
+    unsigned m_cqMask;
+    io_uring_cqe * m_cqes;
+
+    //接收缓冲区
+    char * m_bufs;
+
+    bool m_acceptArmed;         //multishot accept还在进行
+
+    //唤醒
+    int m_wakeFd;
+    uint64_t m_wakeVal;
+    alignas(CACHE_LINE_SIZE) std::atomic<bool> m_notified;     //已经写过eventfd、事件循环还没处理
+    mpmc_queue<http_conn> * m_readq;    //等待读下一个请求的连接
+    mpmc_queue<http_conn> * m_writeq;   //等待发送响应的连接
+};
+
+#endif
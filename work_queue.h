@@ -0,0 +1,281 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <list>
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "locker.h"
+
+//【工作队列】threadPool的队列策略，接口统一为：
+//  Queue(int capacity, int workers)  容量和工作线程数
+//  bool push(T*)        入队，队列满返回false
+//  T* pop(int worker)   第worker个工作线程出队，队列为空时阻塞，被stop()唤醒时返回NULL
+//  void stop()          唤醒所有阻塞在pop上的线程
+//  size_t size()        当前长度（近似值）
+
+#define CACHE_LINE_SIZE 64
+
+//独占一个缓存行的原子变量：多个线程都会修改的全局计数器用它，不会和旁边的变量伪共享
+template<typename T>
+struct alignas(CACHE_LINE_SIZE) padded_atomic : std::atomic<T> {
+    padded_atomic(T value = T()) : std::atomic<T>(value) {}
+    using std::atomic<T>::operator=;
+};
+
+//futex封装：等待*addr不再等于val，以及唤醒最多n个等待者
+inline void futexWait(std::atomic<int> * addr, int val){
+    syscall(SYS_futex, (int *)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+inline void futexWake(std::atomic<int> * addr, int n){
+    syscall(SYS_futex, (int *)addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+inline void cpuRelax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+//互斥锁+信号量+链表实现的队列，每次入队出队都要加锁，入队还要分配链表节点
+template<typename T>
+class locked_queue {
+public:
+    locked_queue(int capacity, int = 1) : m_capacity(capacity), m_stop(false) {}
+
+    bool push(T* request){
+        // 操作工作队列时一定要加锁，因为它被所有线程共享
+        m_queueLocker.lock();
+        //超出最大请求数量，报错
+        if(m_workQueue.size() > m_capacity){
+            m_queueLocker.unlock();
+            return false;
+        }
+
+        m_workQueue.push_back(request);
+        m_queueLocker.unlock();
+        m_queueStat.post();
+        return true;
+    }
+
+    T* pop(int = 0){
+        m_queueStat.wait();
+        m_queueLocker.lock();
+        if(m_workQueue.empty()){
+            m_queueLocker.unlock();
+            return NULL;
+        }
+
+        T* request = m_workQueue.front();
+        m_workQueue.pop_front();
+        m_queueLocker.unlock();
+        return request;
+    }
+
+    void stop(){
+        m_stop = true;
+        m_queueStat.post();
+    }
+
+    size_t size(){
+        m_queueLocker.lock();
+        size_t n = m_workQueue.size();
+        m_queueLocker.unlock();
+        return n;
+    }
+
+private:
+    size_t m_capacity;
+    std::list<T*> m_workQueue;  //请求队列
+    locker m_queueLocker;       //互斥锁
+    sem m_queueStat;            //信号量：判断是否有任务要处理
+    bool m_stop;
+};
+
+//有界无锁多生产者多消费者环形队列（Dmitry Vyukov的算法）
+//每个槽带一个序号，生产者和消费者各自用CAS抢占位置，入队出队都不加锁、不分配内存；
+//队列为空时消费者先自旋一小会儿，再登记为睡眠者并在futex上等待，
+//生产者只在有睡眠者时才调用futex唤醒，队列忙时没有系统调用
+template<typename T>
+class mpmc_queue {
+public:
+    mpmc_queue(int capacity, int workers = 1);
+    ~mpmc_queue();
+
+    bool push(T* request);
+    T* pop(int worker = 0);
+    void stop();
+    size_t size();
+
+    //不阻塞、不唤醒的入队和出队
+    bool tryPush(T* request);
+    bool tryPop(T*& request);
+
+private:
+    //队列为空时自旋的次数
+    static const int SPIN_COUNT = 64;
+
+    struct cell {
+        std::atomic<size_t> seq;
+        T* data;
+    };
+
+private:
+    //生产者和消费者的位置各占一个缓存行，避免互相干扰
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_tail;    //下一个入队位置
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_head;    //下一个出队位置
+
+    //睡眠相关：m_futex是等待的序号，生产者发现有睡眠者时把它加一并唤醒
+    alignas(CACHE_LINE_SIZE) std::atomic<int> m_futex;
+    std::atomic<int> m_sleepers;
+    std::atomic<bool> m_stop;
+
+    //只读的部分单独放一个缓存行
+    alignas(CACHE_LINE_SIZE) cell * m_cells;
+    size_t m_mask;
+    size_t m_limit;     //构造时要求的容量，槽数取整到2的幂后可能更多，入队按这个限制
+};
+
+template<typename T>
+mpmc_queue<T>::mpmc_queue(int capacity, int) :
+    m_tail(0), m_head(0), m_futex(0), m_sleepers(0), m_stop(false), m_limit(capacity) {
+
+    //槽数向上取整到2的幂，下标用掩码计算；队列长度仍然以capacity为上限
+    size_t size = 2;
+    while(size < (size_t)capacity){
+        size <<= 1;
+    }
+    m_cells = new cell[size];
+    m_mask = size - 1;
+    for(size_t i = 0; i < size; ++i){
+        m_cells[i].seq.store(i, std::memory_order_relaxed);
+        m_cells[i].data = NULL;
+    }
+}
+
+template<typename T>
+mpmc_queue<T>::~mpmc_queue(){
+    delete [] m_cells;
+}
+
+template<typename T>
+bool mpmc_queue<T>::tryPush(T* request){
+    size_t pos = m_tail.load(std::memory_order_relaxed);
+    cell * c;
+    while(1){
+        c = &m_cells[pos & m_mask];
+        size_t seq = c->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0){
+            //已经有m_limit个请求了也算满；m_head只会增大，读到旧值只会多算，不会超过上限
+            //pos过时时m_head可能已经越过它，差为负，交给下面的CAS失败重来
+            if((intptr_t)(pos - m_head.load(std::memory_order_relaxed)) >= (intptr_t)m_limit){
+                return false;
+            }
+            //槽是空的，抢占这个位置
+            if(m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                break;
+            }
+        }
+        else if(diff < 0){
+            //转了一圈回来，槽还没被消费：队列满了
+            return false;
+        }
+        else {
+            pos = m_tail.load(std::memory_order_relaxed);
+        }
+    }
+    c->data = request;
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T>
+bool mpmc_queue<T>::tryPop(T*& request){
+    size_t pos = m_head.load(std::memory_order_relaxed);
+    cell * c;
+    while(1){
+        c = &m_cells[pos & m_mask];
+        size_t seq = c->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if(diff == 0){
+            //槽里有数据，抢占这个位置
+            if(m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                break;
+            }
+        }
+        else if(diff < 0){
+            //队列为空
+            return false;
+        }
+        else {
+            pos = m_head.load(std::memory_order_relaxed);
+        }
+    }
+    request = c->data;
+    //把槽标记为下一圈可写
+    c->seq.store(pos + m_mask + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T>
+bool mpmc_queue<T>::push(T* request){
+    if(!tryPush(request)){
+        return false;
+    }
+
+    //与pop中登记睡眠者之后的再次检查配对：要么消费者看到新数据，要么这里看到睡眠者
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(m_sleepers.load(std::memory_order_relaxed) > 0){
+        m_futex.fetch_add(1, std::memory_order_release);
+        futexWake(&m_futex, 1);
+    }
+    return true;
+}
+
+template<typename T>
+T* mpmc_queue<T>::pop(int){
+    T* request = NULL;
+    for(int i = 0; i < SPIN_COUNT; ++i){
+        if(tryPop(request)){
+            return request;
+        }
+        cpuRelax();
+    }
+
+    while(!m_stop.load(std::memory_order_relaxed)){
+        int seq = m_futex.load(std::memory_order_acquire);
+        m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+        if(tryPop(request)){
+            m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+            return request;
+        }
+        //序号没变才睡，生产者在这之间入队会改变序号，futex立即返回
+        futexWait(&m_futex, seq);
+        m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+        if(tryPop(request)){
+            return request;
+        }
+    }
+    return NULL;
+}
+
+template<typename T>
+void mpmc_queue<T>::stop(){
+    m_stop.store(true);
+    m_futex.fetch_add(1);
+    futexWake(&m_futex, INT_MAX);
+}
+
+template<typename T>
+size_t mpmc_queue<T>::size(){
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    size_t head = m_head.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+#endif
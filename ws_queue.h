@@ -0,0 +1,290 @@
+#ifndef WSQUEUE_H
+#define WSQUEUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include "work_queue.h"
+
+//【工作窃取队列】threadPool的另一种队列策略，接口与work_queue.h中的策略相同
+//每个工作线程有自己的收件箱和Chase-Lev双端队列：
+//  - 入队的请求按对象地址（http_conn在users数组中按fd存放，相当于按sockFd）散列到固定的工作线程的收件箱，
+//    同一个连接总是尽量由同一个线程处理，连接的缓冲区留在这个核的缓存里；首选的收件箱满了时放进后面第一个没满的
+//  - 工作线程把收件箱里的请求成批搬进自己的双端队列，从底部取出处理
+//  - 自己没活时先从其他线程的双端队列顶部偷，再从其他线程的收件箱偷，都没有才睡眠
+
+//Chase-Lev双端队列（按Lê等人给出的弱内存模型版本），容量固定不扩容
+//只有所属线程能push/take，其他线程只能steal
+template<typename T>
+class cl_deque {
+public:
+    static const int64_t CAPACITY = 256;
+
+    cl_deque() : m_top(0), m_bottom(0) {
+        for(int64_t i = 0; i < CAPACITY; ++i){
+            m_buf[i].store(NULL, std::memory_order_relaxed);
+        }
+    }
+
+    //所属线程压入底部，满了返回false
+    bool push(T* request){
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        if(b - t >= CAPACITY){
+            return false;
+        }
+        m_buf[b & (CAPACITY - 1)].store(request, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    //所属线程从底部取出，空时返回NULL
+    T* take(){
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+
+        T* request = NULL;
+        if(t <= b){
+            request = m_buf[b & (CAPACITY - 1)].load(std::memory_order_relaxed);
+            if(t == b){
+                //只剩最后一个，和窃取者抢
+                if(!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)){
+                    request = NULL;
+                }
+                m_bottom.store(b + 1, std::memory_order_relaxed);
+            }
+        }
+        else {
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return request;
+    }
+
+    //其他线程从顶部窃取，空或者没抢到时返回NULL
+    T* steal(){
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        if(t < b){
+            T* request = m_buf[t & (CAPACITY - 1)].load(std::memory_order_relaxed);
+            if(m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)){
+                return request;
+            }
+        }
+        return NULL;
+    }
+
+    size_t size(){
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        return b > t ? b - t : 0;
+    }
+
+private:
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> m_top;      //窃取者修改
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> m_bottom;   //所属线程修改
+    alignas(CACHE_LINE_SIZE) std::atomic<T*> m_buf[ CAPACITY ];
+};
+
+template<typename T>
+class ws_queue {
+public:
+    ws_queue(int capacity, int workers);
+    ~ws_queue();
+
+    bool push(T* request);
+    T* pop(int worker);
+    void stop();
+    size_t size();
+
+private:
+    //每次从收件箱搬进双端队列的最大数量
+    static const int DRAIN_BATCH = 32;
+    //没活时自旋窃取的轮数
+    static const int SPIN_COUNT = 16;
+
+    //每个工作线程的数据，各占独立的缓存行
+    struct worker_slot {
+        mpmc_queue<T> * inbox;      //其他线程提交给它的请求
+        cl_deque<T> deque;          //它自己的双端队列
+        alignas(CACHE_LINE_SIZE) std::atomic<int> futex;    //睡眠时等待的序号
+        std::atomic<bool> sleeping;
+    };
+
+    T* findWork(int worker);
+    void wake(int worker);
+    void wakeIdle(int busy);
+
+private:
+    int m_workers;
+    worker_slot * m_slots;
+    alignas(CACHE_LINE_SIZE) std::atomic<int> m_sleepers;
+    std::atomic<bool> m_stop;
+};
+
+template<typename T>
+ws_queue<T>::ws_queue(int capacity, int workers) :
+    m_workers(workers > 0 ? workers : 1), m_sleepers(0), m_stop(false) {
+
+    //总容量平均分给各个收件箱
+    int perWorker = capacity / m_workers + 1;
+    m_slots = new worker_slot[m_workers];
+    for(int i = 0; i < m_workers; ++i){
+        m_slots[i].inbox = new mpmc_queue<T>(perWorker);
+        m_slots[i].futex.store(0);
+        m_slots[i].sleeping.store(false);
+    }
+}
+
+template<typename T>
+ws_queue<T>::~ws_queue(){
+    for(int i = 0; i < m_workers; ++i){
+        delete m_slots[i].inbox;
+    }
+    delete [] m_slots;
+}
+
+template<typename T>
+void ws_queue<T>::wake(int worker){
+    m_slots[worker].futex.fetch_add(1, std::memory_order_release);
+    futexWake(&m_slots[worker].futex, 1);
+}
+
+//叫醒除busy以外的一个正在睡眠的线程
+template<typename T>
+void ws_queue<T>::wakeIdle(int busy){
+    if(m_sleepers.load(std::memory_order_relaxed) == 0){
+        return;
+    }
+    for(int i = 1; i < m_workers; ++i){
+        int other = (busy + i) % m_workers;
+        if(m_slots[other].sleeping.load(std::memory_order_relaxed)){
+            wake(other);
+            return;
+        }
+    }
+}
+
+template<typename T>
+bool ws_queue<T>::push(T* request){
+    //按对象地址选首选的工作线程，地址除以对象大小即对象在数组中的下标
+    //首选的收件箱满了就依次试后面的，所有收件箱都满了才算队列满
+    int preferred = ((uintptr_t)request / sizeof(T)) % m_workers;
+    int worker = preferred;
+    while(!m_slots[worker].inbox->tryPush(request)){
+        worker = (worker + 1) % m_workers;
+        if(worker == preferred){
+            return false;
+        }
+    }
+    worker_slot & slot = m_slots[worker];
+
+    //与pop中登记睡眠之后的再次检查配对
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(slot.sleeping.load(std::memory_order_relaxed)){
+        wake(worker);
+    }
+    else if(slot.inbox->size() > 1){
+        //首选线程正忙且已经积压，叫醒一个空闲线程来偷
+        wakeIdle(worker);
+    }
+    return true;
+}
+
+template<typename T>
+T* ws_queue<T>::findWork(int worker){
+    worker_slot & self = m_slots[worker];
+
+    //先处理自己的
+    T* request = self.deque.take();
+    if(request){
+        return request;
+    }
+
+    //把收件箱里的请求成批搬进双端队列，这样其他线程可以从顶部偷走一部分
+    T* first = NULL;
+    if(self.inbox->tryPop(first)){
+        //只有本线程往双端队列里放，先确认有空位再从收件箱取，保证放得进去
+        for(int i = 1; i < DRAIN_BATCH && (int64_t)self.deque.size() < cl_deque<T>::CAPACITY; ++i){
+            T* next;
+            if(!self.inbox->tryPop(next)){
+                break;
+            }
+            self.deque.push(next);
+        }
+        //搬进来的请求本线程一时处理不完，叫醒一个空闲线程来偷
+        if(self.deque.size() > 0){
+            wakeIdle(worker);
+        }
+        return first;
+    }
+
+    //再偷别人的：先偷双端队列，再偷收件箱
+    for(int i = 1; i < m_workers; ++i){
+        request = m_slots[(worker + i) % m_workers].deque.steal();
+        if(request){
+            return request;
+        }
+    }
+    for(int i = 1; i < m_workers; ++i){
+        if(m_slots[(worker + i) % m_workers].inbox->tryPop(request)){
+            return request;
+        }
+    }
+    return NULL;
+}
+
+template<typename T>
+T* ws_queue<T>::pop(int worker){
+    worker = worker % m_workers;
+    worker_slot & self = m_slots[worker];
+
+    for(int i = 0; i < SPIN_COUNT; ++i){
+        T* request = findWork(worker);
+        if(request){
+            return request;
+        }
+        cpuRelax();
+    }
+
+    while(!m_stop.load(std::memory_order_relaxed)){
+        int seq = self.futex.load(std::memory_order_acquire);
+        self.sleeping.store(true, std::memory_order_seq_cst);
+        m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+
+        T* request = findWork(worker);
+        if(!request){
+            futexWait(&self.futex, seq);
+        }
+
+        self.sleeping.store(false, std::memory_order_relaxed);
+        m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+        if(request || (request = findWork(worker)) != NULL){
+            return request;
+        }
+    }
+    return NULL;
+}
+
+template<typename T>
+void ws_queue<T>::stop(){
+    m_stop.store(true);
+    for(int i = 0; i < m_workers; ++i){
+        m_slots[i].futex.fetch_add(1);
+        futexWake(&m_slots[i].futex, 1);
+    }
+}
+
+template<typename T>
+size_t ws_queue<T>::size(){
+    size_t n = 0;
+    for(int i = 0; i < m_workers; ++i){
+        n += m_slots[i].inbox->size() + m_slots[i].deque.size();
+    }
+    return n;
+}
+
+#endif